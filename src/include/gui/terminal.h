@@ -5,6 +5,7 @@
 #include <std/events.h>
 #include <gui/colors.h>
 #include <gui/objects.h>
+#include <sync.h>
 
 #define MAX_INPUT_BUFFER 64
 
@@ -19,6 +20,9 @@ struct GUITerminal: public File {
 	// stdout:
 	TextBox *textbox;
 
+	// signalled once per key in `input_buf`
+	UserMonitor input_ready;
+
 	GUITerminal() { }
 	void key_handler(char key) {
 
@@ -36,19 +40,19 @@ struct GUITerminal: public File {
 
 		input_buf_tail++;
 
-		sysapi::notify(INPUT_MONITOR, 1);
+		input_ready.notify(1);
 	}
 
 	char getchar() {
 
 		// wait exclusively on input event
-		sysapi::monitor(INPUT_MONITOR, 1);
+		input_ready.wait(1);
 
-		char retval = input_buf[input_buf_head];
+		char retval = input_buf[input_buf_head % MAX_INPUT_BUFFER];
 
 		input_buf_head++;
 
-		sysapi::unmonitor(INPUT_MONITOR);
+		input_ready.release();
 
 		return retval;
 	}
@@ -60,10 +64,14 @@ struct GUITerminal: public File {
 		int len=0;
 
 		char nextchar = 0;
+
+		// hold the input for the whole line
+		input_ready.enter();
+
 		do {
 
-			// wait exclusively on input event
-			sysapi::monitor(INPUT_MONITOR, 1);
+			// wait for the next key
+			input_ready.wait_held(1);
 
 			nextchar = input_buf[input_buf_head % MAX_INPUT_BUFFER];
 			input_buf_head++;
@@ -96,7 +104,7 @@ struct GUITerminal: public File {
 			
 		} while (nextchar != '\n');
 
-		sysapi::unmonitor(INPUT_MONITOR);
+		input_ready.release();
 
 		return len;
 	}
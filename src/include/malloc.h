@@ -0,0 +1,19 @@
+#pragma once
+
+#include <std/types.h>
+
+/*
+ User-space heap, part of libsystem.
+
+ Small sizes are rounded up to a power-of-two size class. Each 4K page holds objects of one class and nothing else. A side table, one byte per page, records the class, so `free()` finds it by rounding the pointer down to its page.
+ Every thread keeps its own free lists and only takes the shared lists' lock to move a batch of objects in or out.
+ Anything bigger than the largest class gets pages of its own straight from `sysapi::alloc()`, behind a small header.
+*/
+
+// size classes are 2^MALLOC_MIN_SHIFT .. 2^MALLOC_MAX_SHIFT bytes
+#define MALLOC_MIN_SHIFT 4
+#define MALLOC_MAX_SHIFT 11
+#define MALLOC_CLASSES   (MALLOC_MAX_SHIFT - MALLOC_MIN_SHIFT + 1)
+
+extern "C" void *malloc(size_t size);
+extern "C" void free(void *ptr);
@@ -26,3 +26,20 @@ static uint atomic_add_limit(uint &val, uint diff, uint limit) {
 	}
 	return limit;
 }
+
+struct SpinLock {
+// busy-wait mutex for short critical sections. Callers that can race with interrupt handlers must disable interrupts first (see `irq_save()`)
+	volatile uint locked;
+
+	SpinLock() {
+		locked = 0;
+	}
+	void lock() volatile {
+		while (__sync_lock_test_and_set(&locked, 1)) {
+			while (locked) __asm__ volatile("pause");
+		}
+	}
+	void unlock() volatile {
+		__sync_lock_release(&locked);
+	}
+};
@@ -11,6 +11,13 @@ static uint rotright(uint val, uint bits) {
 	return (val >> b32) | (val << (32 - b32));
 }
 
+static uint div64(unsigned long long dividend, uint divisor) {
+	// 64/32 bit division, the quotient has to fit in 32 bits. Saves pulling in libgcc's __udivdi3
+	uint quotient, remainder;
+	__asm__("divl %4":"=a"(quotient), "=d"(remainder):"a"((uint) dividend), "d"((uint) (dividend >> 32)), "r"(divisor));
+	return quotient;
+}
+
 static uint bitscan_forward(uint data) {
 	int retval = 0;
 	__asm__ volatile(
@@ -20,6 +27,17 @@ static uint bitscan_forward(uint data) {
 	return retval;
 }
 
+static uint bitscan_reverse(uint data) {
+	// index of the most significant set bit, `data` must not be 0
+	uint retval = 0;
+	__asm__ volatile(
+		"bsrl %1, %0\n"
+		:"=r" (retval)
+		:"rm" (data)
+	);
+	return retval;
+}
+
 static int high_ones(int num_bits) {
 	// returns an int with `num_bits` of the most significant bits set to 1
 	int invbits = 32 - num_bits;
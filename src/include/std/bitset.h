@@ -10,23 +10,112 @@
 
 
 
+/*
+ Each bit in `bitset_blocks` is an allocatable item: 0=free 1=used.
+
+ Above that are two summary levels so a search can skip full blocks without touching them:
+ `summary_blocks` has one bit per block meaning "this block may have free bits", and each bit of `summary_top` means "this summary word is non-zero".
+ The summaries are hints: a set bit can be stale (the search then moves on), but a block with free bits always has its bit set once whoever is changing it is done.
+ This caps N at 32 * 32 * 32 blocks = 2^20 bits.
+
+ When the size is only known at runtime, construct a `BitAllocator<>` with a bit count in `storage_bytes(bits)` of memory; the blocks and summary then follow the header.
+*/
 template <int N=0>
 struct BitAllocator {
 
 	uint max_blocks;
 	uint max_bits;	
+	volatile uint summary_top;
+	// points at `summary_storage` (or just past the blocks, when sized at runtime), so `BitAllocator<>` can always find it
+	volatile uint *summary_blocks;
 	volatile uint bitset_blocks[(N+31)/32];
+	volatile uint summary_storage[(N+1023)/1024];
 
 	BitAllocator() {
-		max_bits = N;
-		max_blocks = (N+31) / 32;
+		static_assert(N <= (1 << 20), "BitAllocator summary only covers 2^20 bits");
+
+		init(N, summary_storage);
+	}
+
+	BitAllocator(uint bits) {
+		// only for `BitAllocator<>`, see above
+		if (bits > (1 << 20)) bits = (1 << 20);
+
+		init(bits, &bitset_blocks[(bits + 31) / 32]);
+	}
+
+	static uint storage_bytes(uint bits) {
+		return sizeof(BitAllocator<>) + (((bits + 31) / 32) + ((bits + 1023) / 1024)) * sizeof(uint);
+	}
+
+	void init(uint bits, volatile uint *summary) {
+		max_bits = bits;
+		max_blocks = (bits+31) / 32;
+		summary_blocks = summary;
 		memset((void *) bitset_blocks, (uint) 0, max_blocks * 4);
+
+		// bits past the end of a partial last block are never free:
+		if (max_bits % 32) {
+			bitset_blocks[max_blocks - 1] = high_ones(32 - (max_bits % 32));
+		}
+
+		uint summary_words = (max_blocks + 31) / 32;
+		for (uint s = 0; s < summary_words; s++) {
+			summary_blocks[s] = -1;
+		}
+		if (max_blocks % 32) {
+			summary_blocks[summary_words - 1] = low_ones(max_blocks % 32);
+		}
+		summary_top = low_ones(summary_words);
 	}
 
 	inline uint get_block_index(uint bit_index) {
 		return (uint) bit_index / 32;
 	}
 
+	void mark_block_free(uint block_index) {
+		// set the summary hints for a block that has free bits
+		uint s = block_index / 32;
+		__sync_fetch_and_or(&summary_blocks[s], 1 << (block_index % 32));
+		__sync_fetch_and_or(&summary_top, 1 << s);
+	}
+
+	void mark_block_full(uint block_index) {
+		// clear the summary hints for a block with no free bits
+		uint s = block_index / 32;
+		uint remaining = __sync_and_and_fetch(&summary_blocks[s], ~(1 << (block_index % 32)));
+
+		// someone may have freed a bit in this block since it filled up, and their hint is what we just cleared:
+		if (bitset_blocks[block_index] != -1) {
+			mark_block_free(block_index);
+			return;
+		}
+
+		if (remaining == 0) {
+			__sync_fetch_and_and(&summary_top, ~(1 << s));
+			// someone may have freed a bit in this summary word in the meantime:
+			if (summary_blocks[s] != 0) __sync_fetch_and_or(&summary_top, 1 << s);
+		}
+	}
+
+	int next_free_block(uint start_block_index) {
+		// find the first block at or after `start_block_index` that is marked as having free bits
+		// returns -1 if there isn't one
+		if (start_block_index >= max_blocks) return -1;
+
+		uint s = start_block_index / 32;
+		uint bits = summary_blocks[s] & ~low_ones(start_block_index % 32);
+
+		while (bits == 0) {
+			uint top = summary_top & ~low_ones(s + 1);
+			if (top == 0) return -1;
+
+			s = bitscan_forward(top);
+			bits = summary_blocks[s];
+		}
+
+		return (s * 32) + bitscan_forward(bits);
+	}
 
 	uint lock_block(uint block_index) {
 		// try to lock a 32-bit block at once by atomically swapping with 0xFFFFFFFF
@@ -39,23 +128,31 @@ struct BitAllocator {
 	// find the next block after `start_block_index` that has a free bit and lock the block
 	// returns the index of the locked block,
 	// `locked_bits` is set to the block's value
-		for (uint i = start_block_index; i < max_blocks; i++) {
+		*locked_bits = -1;
+		int i = next_free_block(start_block_index);
+		while (i >= 0) {
 			*locked_bits = lock_block(i);
 			if (*locked_bits != -1) return i;
+
+			// full or locked by someone else, whoever holds it will fix the hint
+			i = next_free_block(i + 1);
 		}
 		// failure if locked_bits==-1 or if this returns 0
 		return 0;
 	}
 
 	int lock_next_bit(uint start_block_index) {
-		// atomically locks the next free bit after `start_block_index`
+		// atomically locks the next free bit after `start_block_index`, wrapping around at the end
 		// returns the locked bit index
-		for (uint i = start_block_index; i < (start_block_index + max_blocks); i++) {
-			int block_index = i % max_blocks;
+		int i = next_free_block(start_block_index);
+		if (i < 0) i = next_free_block(0);
+
+		for (uint tries = 0; (i >= 0) && (tries < max_blocks); tries++) {
+			uint block_index = i;
 			uint bits = bitset_blocks[block_index];
 			for (int j = 0; (j < 32) && (bits != -1); j++) {
 				uint bit_index = bitscan_forward(~bits);
-				uint final_index = bit_index + (i * 32);
+				uint final_index = bit_index + (block_index * 32);
 				if (final_index >= max_bits) return -1;
 
 				uint new_bits = bits | (1 << bit_index);
@@ -63,10 +160,13 @@ struct BitAllocator {
 
 				bits = __sync_val_compare_and_swap(&bitset_blocks[block_index], bits, new_bits);
 				if (old_bits == bits) {
-					return bit_index + (block_index * 32);
+					if (new_bits == -1) mark_block_full(block_index);
+					return final_index;
 				}
 			}
 
+			i = next_free_block(block_index + 1);
+			if (i < 0) i = next_free_block(0);
 		}
 		return -1;
 	}
@@ -81,12 +181,19 @@ struct BitAllocator {
 	void unlock_bit(uint bit_index) {
 		uint block_index = get_block_index(bit_index);
 		uint bit_in_block = bit_index & 0x1F;
-		bitset_blocks[block_index] &= ~(1 << bit_in_block);
+		__sync_fetch_and_and(&bitset_blocks[block_index], ~(1 << bit_in_block));
+		mark_block_free(block_index);
 	}
 
 	void unlock_block(uint new_bits, uint block_index) {
 	// unlock a previously locked block by settings its bits to a new value (even -1 is valid)
 		bitset_blocks[block_index] = new_bits;
+
+		if (new_bits == -1) {
+			mark_block_full(block_index);
+		} else {
+			mark_block_free(block_index);
+		}
 	}
 
 	int lock_bitmask(uint block_index, uint bitmask) {
@@ -101,12 +208,29 @@ struct BitAllocator {
 		}
 		
 		uint new_locked_bits = (~locked_bitmask) & bitmask;
-		bitset_blocks[block_index] = locked_bitmask | bitmask;
+		unlock_block(locked_bitmask | bitmask, block_index);
 
 		return new_locked_bits;
 	}
 
 
+	void unlock_bit_range(uint start, uint size) {
+		// frees every bit in [start, start + size)
+		uint end = start + size;
+
+		while (start < end) {
+			uint block_index = get_block_index(start);
+			uint first = start % 32;
+			uint count = 32 - first;
+			if (count > end - start) count = end - start;
+
+			__sync_fetch_and_and(&bitset_blocks[block_index], ~(low_ones(count) << first));
+			mark_block_free(block_index);
+
+			start += count;
+		}
+	}
+
 	void lock_bit_range(uint start, uint size) {
 
 		uint start_index = get_block_index(start);
@@ -136,7 +260,16 @@ struct BitAllocator {
 		lock_bitmask(end_index, tail_mask);
 	}
 
-
+	uint count_free() {
+		// number of free bits, only a snapshot while others are allocating
+		uint free = 0;
+		for (uint i = 0; i < max_blocks; i++) {
+			for (uint used = bitset_blocks[i]; used != 0xFFFFFFFF; used |= used + 1) {
+				free++;
+			}
+		}
+		return free;
+	}
 
 };
 
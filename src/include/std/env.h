@@ -6,6 +6,13 @@
 
 #define MAX_PROC_MSGS    64
 #define MAX_PROC_WINDOWS 16
+#define MAX_ENV_THREADS  16
+
+// user stack of one thread, so libsystem can tell threads apart by their stack pointer
+struct ThreadStack {
+	uint base;
+	uint limit;
+};
 
 
 struct Environment {
@@ -19,12 +26,20 @@ This is used for things like notifying the process of events that it subscribed
 	// TODO this needn't be in shared mem
 	File *user_filetable[MAX_PROC_FILES];
 	Window windows[MAX_PROC_WINDOWS];
+	// filled in by the kernel as threads are created, indexed like the process's threads
+	ThreadStack thread_stacks[MAX_ENV_THREADS];
+	// TSC cycles per millisecond, so user code can keep time without a syscall
+	uint tsc_per_ms;
 	// start of free data. maybe add a *next pointer some day
 	uchar free[0];
 	Environment() {
 		for (int i = 0; i < MAX_PROC_FILES; i++) {
 			user_filetable[i] = nullptr;
 		}
+		for (int i = 0; i < MAX_ENV_THREADS; i++) {
+			thread_stacks[i].base = 0;
+			thread_stacks[i].limit = 0;
+		}
 	}
 };
 
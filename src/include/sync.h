@@ -0,0 +1,201 @@
+#pragma once
+
+#include <std/types.h>
+#include <std/bitops.h>
+#include <system.h>
+
+/*
+ User-space locks built on futexes.
+
+ The lock word lives in the process's own memory and is taken with a `cmpxchg`, so an uncontended lock or unlock never leaves user mode.
+ The kernel is only entered to sleep on the word (`sysapi::futex_wait`) or to wake whoever sleeps on it (`sysapi::futex_wake`).
+ All-zero memory is a valid unlocked `Mutex` or `UserRWLock`, an unsignalled `UserMonitor` and an empty `UserSemaphore`, so they work as globals without constructors.
+*/
+
+struct Mutex {
+	// 0: unlocked, 1: locked, 2: locked and someone may be sleeping on it
+	volatile uint state;
+
+	Mutex(): state(0) { }
+
+	bool try_lock() {
+		return __sync_bool_compare_and_swap(&state, 0, 1);
+	}
+
+	void lock() {
+		uint seen = __sync_val_compare_and_swap(&state, 0, 1);
+		if (seen == 0) return;
+
+		// contended: mark it so the owner's `unlock()` knows to wake us, then sleep until it's free
+		if (seen != 2) seen = __sync_lock_test_and_set(&state, 2);
+		while (seen != 0) {
+			sysapi::futex_wait(&state, 2);
+			seen = __sync_lock_test_and_set(&state, 2);
+		}
+	}
+
+	void unlock() {
+		if (__sync_fetch_and_sub(&state, 1) != 1) {
+			// it was 2, wake one sleeper
+			state = 0;
+			sysapi::futex_wake(&state, 1);
+		}
+	}
+};
+
+struct UserMonitor {
+// the same protocol as `sysapi::monitor`/`unmonitor`/`notify`, for monitors that only threads of one process use
+	Mutex mutex;
+	volatile int signal;
+	// threads inside `wait()`'s futex_wait, `notify()` skips the syscall when there are none
+	volatile uint waiting;
+
+	UserMonitor(): signal(0), waiting(0) { }
+
+	void enter() {
+		// take the monitor without waiting for a signal
+		mutex.lock();
+	}
+
+	void wait(int diff=1) {
+		// take the monitor, wait for `signal` > 0 and subtract up to `diff` from it. Holds the monitor until `release()`
+		enter();
+		wait_held(diff);
+	}
+
+	void wait_held(int diff=1) {
+		// `wait()` for a thread that already holds the monitor (the mutex isn't recursive)
+		for (int seen = signal; seen <= 0; seen = signal) {
+			__sync_fetch_and_add(&waiting, 1);
+			// returns straight away if `notify()` changed `signal` since we looked
+			sysapi::futex_wait((volatile uint *) &signal, (uint) seen);
+			__sync_fetch_and_sub(&waiting, 1);
+		}
+
+		// `notify()` may be adding at the same time
+		int seen, left;
+		do {
+			seen = signal;
+			left = (seen > diff) ? (seen - diff) : 0;
+		} while (!__sync_bool_compare_and_swap(&signal, seen, left));
+	}
+
+	void release() {
+		mutex.unlock();
+	}
+
+	void notify(int diff=1) {
+		__sync_fetch_and_add(&signal, diff);
+		if (waiting != 0) sysapi::futex_wake((volatile uint *) &signal, 1);
+	}
+};
+
+struct UserSemaphore {
+// counts like `sysapi::sem_wait`/`sem_post`, without a syscall unless someone has to sleep
+	volatile int count;
+	// threads inside `wait()`'s futex_wait
+	volatile uint waiting;
+
+	UserSemaphore(int count=0): count(count), waiting(0) { }
+
+	bool try_wait() {
+		for (int seen = count; seen > 0; seen = count) {
+			if (__sync_bool_compare_and_swap(&count, seen, seen - 1)) return true;
+		}
+		return false;
+	}
+
+	// false if `timeout_ms` (0 = forever) ran out first
+	bool wait(uint timeout_ms=0) {
+		if (try_wait()) return true;
+
+		// one deadline for the whole wait, however often we're woken and lose the unit to another thread
+		uint tsc_per_ms = 0;
+		unsigned long long deadline = 0;
+		if (timeout_ms != 0) {
+			if (sysapi::process_env == nullptr) sysapi::process_env = sysapi::get_environment();
+			tsc_per_ms = sysapi::process_env->tsc_per_ms;
+			deadline = __builtin_ia32_rdtsc() + (unsigned long long) timeout_ms * tsc_per_ms;
+		}
+
+		while (!try_wait()) {
+			uint wait_ms = 0;
+			if (timeout_ms != 0) {
+				unsigned long long now = __builtin_ia32_rdtsc();
+				if (now >= deadline) return false;
+				// rounded up, a 0 would wait forever
+				wait_ms = div64(deadline - now, tsc_per_ms) + 1;
+			}
+
+			__sync_fetch_and_add(&waiting, 1);
+			int woken = sysapi::futex_wait((volatile uint *) &count, 0, wait_ms);
+			__sync_fetch_and_sub(&waiting, 1);
+
+			if (woken < 0) return try_wait();
+		}
+		return true;
+	}
+
+	void post(int n=1) {
+		__sync_fetch_and_add(&count, n);
+		if (waiting != 0) sysapi::futex_wake((volatile uint *) &count, n);
+	}
+};
+
+struct UserRWLock {
+// any number of readers or one writer. Once a writer is waiting new readers wait behind it, so writers can't starve
+	enum : uint {
+		READERS        = 0x0000FFFF,
+		WRITER_WAITING = 0x00010000, // one waiting writer, the count sits in bits 16..30
+		WRITER         = 0x80000000
+	};
+
+	volatile uint state;
+	// threads sleeping on `state`
+	volatile uint waiting;
+
+	UserRWLock(): state(0), waiting(0) { }
+
+	void read_lock() {
+		for (;;) {
+			uint seen = state;
+			if ((seen & ~READERS) == 0) {
+				if (__sync_bool_compare_and_swap(&state, seen, seen + 1)) return;
+				continue;
+			}
+			sleep(seen);
+		}
+	}
+
+	void write_lock() {
+		// counted as waiting from here on, which holds back new readers
+		__sync_fetch_and_add(&state, WRITER_WAITING);
+		for (;;) {
+			uint seen = state;
+			if ((seen & (WRITER | READERS)) == 0) {
+				if (__sync_bool_compare_and_swap(&state, seen, seen - WRITER_WAITING + WRITER)) return;
+				continue;
+			}
+			sleep(seen);
+		}
+	}
+
+	void unlock() {
+		// readers can't hold it alongside a writer, so the writer bit says which side we had
+		if (state & WRITER) {
+			__sync_fetch_and_sub(&state, WRITER);
+		} else {
+			__sync_fetch_and_sub(&state, 1);
+		}
+		// readers and writers sleep on the same word, they sort out among themselves who goes next
+		if (waiting != 0) sysapi::futex_wake(&state, (uint) -1);
+	}
+
+private:
+	void sleep(uint seen) {
+		__sync_fetch_and_add(&waiting, 1);
+		// returns straight away if `state` changed since we looked
+		sysapi::futex_wait(&state, seen);
+		__sync_fetch_and_sub(&waiting, 1);
+	}
+};
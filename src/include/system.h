@@ -10,6 +10,7 @@ enum SyscallCode {
 
 	SYSCALL_ALLOC,
 	SYSCALL_ALLOC_AT,
+	SYSCALL_FREE,
 
 	SYSCALL_OPEN,
 	SYSCALL_SEEK,
@@ -17,21 +18,39 @@ enum SyscallCode {
 	SYSCALL_WRITE,
 
 	SYSCALL_NEW_THREAD,
+	SYSCALL_THREAD_EXIT,
+	SYSCALL_THREAD_JOIN,
 	SYSCALL_YIELD,
+	SYSCALL_SET_PRIORITY,
+	SYSCALL_SLEEP,
 
 	SYSCALL_GET_ENV,
 	SYSCALL_SUBSCRIBE,
 
 	SYSCALL_LOCK,
+	SYSCALL_TIMED_LOCK,
 	SYSCALL_UNLOCK,
 
 	SYSCALL_MONITOR,
 	SYSCALL_UNMONITOR,
 	SYSCALL_NOTIFY,
+	SYSCALL_WAIT_ANY,
+
+	SYSCALL_FUTEX_WAIT,
+	SYSCALL_FUTEX_WAKE,
+
+	SYSCALL_RWLOCK_READ,
+	SYSCALL_RWLOCK_WRITE,
+	SYSCALL_RWLOCK_UNLOCK,
+
+	SYSCALL_SEM_WAIT,
+	SYSCALL_SEM_POST,
 
 	SYSCALL_UPDATE_GUI,
 	SYSCALL_REDRAW_GUI,
 
+	SYSCALL_MEM_STATS,
+
 	MAX
 };
 
@@ -72,14 +91,70 @@ struct SyscallThreadParams {
 	}
 };
 
+struct MemStats {
+	// counted per process:
+	uint resident_pages;    // frames mapped in user space
+	uint page_table_pages;  // page tables allocated for user space
+	uint cow_faults;
+	uint demand_faults;
+	uint alloc_bytes;       // held from SYSCALL_ALLOC and SYSCALL_ALLOC_AT
+
+	// whole system, filled in by SYSCALL_MEM_STATS:
+	uint total_frames;
+	uint free_frames;
+	void dump() {
+		//debug(9, "MemStats: resident=", resident_pages, " page tables=", page_table_pages, " free frames=", free_frames);
+	}
+};
+
+struct SyscallJoinParams {
+	int thread_id;
+	// filled in with what the thread passed to SYSCALL_THREAD_EXIT
+	int exit_code;
+};
+
+struct SyscallLockParams {
+	// a lock handle, or an rwlock handle for SYSCALL_RWLOCK_READ and SYSCALL_RWLOCK_WRITE
+	int lock_h;
+	uint timeout_ms;
+};
+
+struct SyscallSemParams {
+	int sem_h;
+	// SYSCALL_SEM_POST only
+	int count;
+	// SYSCALL_SEM_WAIT only, 0 waits forever
+	uint timeout_ms;
+};
+
 struct SyscallMonitorParams {
 	int monitor_h;
 	int diff;
+	// SYSCALL_MONITOR only, 0 waits forever
+	uint timeout_ms;
 	void dump() {
 		//debug(9, "SyscallMonitorParams: monitor_h=", (hex) monitor_h, " diff=", (hex) diff);
 	}
 };
 
+// how many monitors one SYSCALL_WAIT_ANY can watch, one bit each in the ready mask it returns
+#define MAX_WAIT_ANY 32
+
+struct SyscallWaitAnyParams {
+	const int *monitor_hs;
+	uint count;
+	// 0 waits forever
+	uint timeout_ms;
+};
+
+struct SyscallFutexParams {
+	volatile uint *addr;
+	// FUTEX_WAIT: the value we expect to find at `addr`. FUTEX_WAKE: how many waiters to wake
+	uint value;
+	// FUTEX_WAIT only, 0 waits forever
+	uint timeout_ms;
+};
+
 
 namespace sysapi {
 	extern Environment *process_env;
@@ -106,6 +181,7 @@ namespace sysapi {
 
 	extern void *alloc(int pages); 
 	extern void *alloc_at(int pages, void *vaddr); 
+	extern int free(void *vaddr);
 
 	extern int open(const char *name);
 	extern int seek(int fh, int offset);
@@ -138,19 +214,48 @@ namespace sysapi {
 		}
 	}
 
+	// returns the new thread's id, or -1. A thread must end with `thread_exit()`, its function can't return
 	extern int new_thread(void *function);
+	__attribute__((noreturn))
+	extern void thread_exit(int exit_code=0);
+	// wait for thread `thread_id` to exit and free it, 0 if it can't be joined. Only one thread can join each thread
+	extern int thread_join(int thread_id, int *exit_code=nullptr);
 	extern int yield();
+	// 8 (most urgent a user thread can be) .. 31, threads start at 16
+	extern int set_priority(int priority);
+	extern int sleep(uint ms);
 
 	extern Environment *get_environment();
 	extern int subscribe(UserEvents event);
 
-	extern int lock(int lock_h);
+	// with a `timeout_ms`, these return 0 if it ran out first (a timed-out monitor isn't held)
+	extern int lock(int lock_h, uint timeout_ms=0);
 	extern int unlock(int lock_h);
 
-	extern int monitor(int monitor_h, int diff=1);
+	extern int monitor(int monitor_h, int diff=1, uint timeout_ms=0);
 	extern int unmonitor(int monitor_h);
 	extern int notify(int monitor_h, int diff=1);
 
+	// block until any of `monitor_hs` is signalled, returns a mask with bit `i` set for each ready `monitor_hs[i]` (0 on timeout)
+	// nothing is taken, `monitor()` the ready ones to consume their signal
+	extern uint wait_any(const int *monitor_hs, uint count, uint timeout_ms=0);
+
+	// kernel rwlocks and semaphores, for threads of one process. Semaphores start at 0, post to give them a count
+	// sync.h has cheaper versions that only enter the kernel when they have to wait
+	extern int rwlock_read(int rwlock_h, uint timeout_ms=0);
+	extern int rwlock_write(int rwlock_h, uint timeout_ms=0);
+	extern int rwlock_unlock(int rwlock_h);
+
+	extern int sem_wait(int sem_h, uint timeout_ms=0);
+	extern int sem_post(int sem_h, int count=1);
+
+	// sleep while *addr == expected: 1 when woken, 0 if it wasn't equal, -1 on timeout. See sync.h
+	extern int futex_wait(volatile uint *addr, uint expected, uint timeout_ms=0);
+	// returns how many threads were woken
+	extern int futex_wake(volatile uint *addr, uint count=1);
+
 	extern int update_gui();
 	extern int redraw_gui();
+
+	extern int mem_stats(MemStats *stats);
 };
@@ -0,0 +1,219 @@
+#include <std/types.h>
+#include <std/bitops.h>
+#include <std/env.h>
+#include <system.h>
+#include <sync.h>
+#include <malloc.h>
+
+// `LargeHeader` at the start of a large allocation, padded so the object stays 16-byte aligned
+#define MALLOC_HEADER_BYTES 16
+
+// objects a thread keeps per class before giving MALLOC_BATCH of them back
+#define MALLOC_CACHE_MAX 64
+#define MALLOC_BATCH     32
+
+// pages asked from the kernel at a time for new size-class pages (mapped on first touch)
+#define MALLOC_CHUNK_PAGES 16
+
+struct LargeHeader {
+	uint pages;
+};
+
+struct FreeObject {
+	FreeObject *next;
+};
+
+struct FreeList {
+	FreeObject *head;
+	uint count;
+
+	void push(FreeObject *obj) {
+		obj->next = head;
+		head = obj;
+		count++;
+	}
+
+	FreeObject *pop() {
+		FreeObject *obj = head;
+		if (obj != nullptr) {
+			head = obj->next;
+			count--;
+		}
+		return obj;
+	}
+};
+
+struct ThreadCache {
+	FreeList lists[MALLOC_CLASSES];
+};
+
+static ThreadCache thread_caches[MAX_ENV_THREADS];
+
+// shared by all threads, and used directly by any thread we can't identify
+static FreeList central[MALLOC_CLASSES];
+static Mutex central_locks[MALLOC_CLASSES];
+
+static char *chunk_next;
+static char *chunk_end;
+static Mutex chunk_lock;
+
+// size class + 1 of every page carved into objects, 0 for anything else (a large allocation)
+// one table per 4MB of address space, allocated when we first carve a page there
+static uchar *page_classes[1024];
+
+static uchar *page_class_entry(void *page) {
+	// nullptr if nothing in `page`'s 4MB was ever carved
+	uchar *table = page_classes[(uint) page >> 22];
+	return (table == nullptr) ? nullptr : &table[((uint) page >> 12) & 0x3FF];
+}
+
+static int thread_index() {
+	// which of our threads this is, from the stack it's running on
+	// returns -1 if the stack isn't one the kernel told us about
+	if (sysapi::process_env == nullptr) {
+		sysapi::process_env = sysapi::get_environment();
+	}
+
+	uint esp;
+	__asm__ volatile("movl %%esp, %0":"=r"(esp));
+
+	ThreadStack *stacks = sysapi::process_env->thread_stacks;
+	for (int t = 0; t < MAX_ENV_THREADS; t++) {
+		if ((esp >= stacks[t].base) && (esp < stacks[t].limit)) return t;
+	}
+	return -1;
+}
+
+static uint size_class(size_t size) {
+	if (size <= (1 << MALLOC_MIN_SHIFT)) return 0;
+	return bitscan_reverse(size - 1) + 1 - MALLOC_MIN_SHIFT;
+}
+
+static bool carve_page(uint c, FreeList *list) {
+	// split a fresh page into objects of class `c` and put them on `list`
+	chunk_lock.lock();
+	if (chunk_next == chunk_end) {
+		chunk_next = (char *) sysapi::alloc(MALLOC_CHUNK_PAGES);
+		chunk_end = (chunk_next == nullptr) ? nullptr : chunk_next + MALLOC_CHUNK_PAGES * 4096;
+	}
+	char *page = chunk_next;
+	if (page != nullptr) {
+		uchar **table = &page_classes[(uint) page >> 22];
+		if (*table == nullptr) *table = (uchar *) sysapi::alloc(1);
+		if (*table == nullptr) {
+			page = nullptr;
+		} else {
+			chunk_next += 4096;
+			(*table)[((uint) page >> 12) & 0x3FF] = c + 1;
+		}
+	}
+	chunk_lock.unlock();
+
+	if (page == nullptr) return false;
+
+	// no header, the whole page is objects
+	uint obj_size = 1 << (c + MALLOC_MIN_SHIFT);
+	// back to front, so objects come out in address order
+	for (int offset = 4096 - obj_size; offset >= 0; offset -= obj_size) {
+		list->push((FreeObject *) (page + offset));
+	}
+	return true;
+}
+
+static void *large_alloc(size_t size) {
+	uint pages = (size + MALLOC_HEADER_BYTES + 4095) / 4096;
+
+	char *page = (char *) sysapi::alloc(pages);
+	if (page == nullptr) return nullptr;
+
+	((LargeHeader *) page)->pages = pages;
+
+	return page + MALLOC_HEADER_BYTES;
+}
+
+static void *central_alloc(uint c) {
+	central_locks[c].lock();
+	if (central[c].head == nullptr) carve_page(c, &central[c]);
+	void *obj = central[c].pop();
+	central_locks[c].unlock();
+
+	return obj;
+}
+
+static void central_free(uint c, FreeObject *obj) {
+	central_locks[c].lock();
+	central[c].push(obj);
+	central_locks[c].unlock();
+}
+
+extern "C" void *malloc(size_t size) {
+	if (size == 0) size = 1;
+	if (size > (1 << MALLOC_MAX_SHIFT)) return large_alloc(size);
+
+	uint c = size_class(size);
+
+	int t = thread_index();
+	if (t < 0) return central_alloc(c);
+
+	FreeList *cache = &thread_caches[t].lists[c];
+	if (cache->head == nullptr) {
+		// refill with a batch from the shared list, or a new page if it's empty
+		central_locks[c].lock();
+		for (uint i = 0; (i < MALLOC_BATCH) && (central[c].head != nullptr); i++) {
+			cache->push(central[c].pop());
+		}
+		central_locks[c].unlock();
+
+		if (cache->head == nullptr) carve_page(c, cache);
+	}
+
+	return cache->pop();
+}
+
+extern "C" void free(void *ptr) {
+	if (ptr == nullptr) return;
+
+	void *page = (void *) ((uint) ptr & 0xFFFFF000);
+	uchar *entry = page_class_entry(page);
+	if ((entry == nullptr) || (*entry == 0)) {
+		// a large allocation starts at its page, after the header
+		sysapi::free(page);
+		return;
+	}
+
+	uint c = *entry - 1;
+
+	int t = thread_index();
+	if (t < 0) {
+		central_free(c, (FreeObject *) ptr);
+		return;
+	}
+
+	FreeList *cache = &thread_caches[t].lists[c];
+	cache->push((FreeObject *) ptr);
+
+	if (cache->count > MALLOC_CACHE_MAX) {
+		// give a batch back so other threads can use it
+		central_locks[c].lock();
+		for (uint i = 0; i < MALLOC_BATCH; i++) {
+			central[c].push(cache->pop());
+		}
+		central_locks[c].unlock();
+	}
+}
+
+void *operator new(size_t size) {
+	return malloc(size);
+}
+
+void *operator new[](size_t size) {
+	return malloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	free(ptr);
+}
@@ -17,6 +17,10 @@ namespace sysapi {
 		return (void *) syscall(SYSCALL_ALLOC_AT, &params);
 	}
 
+	extern int free(void *vaddr) {
+		return syscall(SYSCALL_FREE, vaddr);
+	}
+
 	extern int open(const char *name) {
 		return syscall(SYSCALL_OPEN, (void *) name);
 	}
@@ -36,10 +40,33 @@ namespace sysapi {
 		return syscall(SYSCALL_NEW_THREAD, &params);
 	}
 
+	extern void thread_exit(int exit_code) {
+		syscall(SYSCALL_THREAD_EXIT, (void *) exit_code);
+		// the kernel never comes back here
+		while (true);
+	}
+
+	extern int thread_join(int thread_id, int *exit_code) {
+		SyscallJoinParams params;
+		params.thread_id = thread_id;
+		params.exit_code = 0;
+		int joined = syscall(SYSCALL_THREAD_JOIN, &params);
+		if (exit_code != nullptr) *exit_code = params.exit_code;
+		return joined;
+	}
+
 	extern int yield() {
 		return syscall(SYSCALL_YIELD, nullptr);
 	}
 
+	extern int set_priority(int priority) {
+		return syscall(SYSCALL_SET_PRIORITY, (void *) priority);
+	}
+
+	extern int sleep(uint ms) {
+		return syscall(SYSCALL_SLEEP, (void *) ms);
+	}
+
 	extern Environment *get_environment() {
 		return (Environment *) syscall(SYSCALL_GET_ENV, nullptr);
 	}
@@ -48,18 +75,24 @@ namespace sysapi {
 		return syscall(SYSCALL_SUBSCRIBE, (void *) event);
 	}
 
-	extern int lock(int lock_h) {
-		return syscall(SYSCALL_LOCK, (void *) lock_h);
+	extern int lock(int lock_h, uint timeout_ms) {
+		if (timeout_ms == 0) return syscall(SYSCALL_LOCK, (void *) lock_h);
+
+		SyscallLockParams params;
+		params.lock_h = lock_h;
+		params.timeout_ms = timeout_ms;
+		return syscall(SYSCALL_TIMED_LOCK, &params);
 	}
 
 	extern int unlock(int lock_h) {
 		return syscall(SYSCALL_UNLOCK, (void *) lock_h);
 	}
 
-	extern int monitor(int monitor_h, int diff) {
+	extern int monitor(int monitor_h, int diff, uint timeout_ms) {
 		SyscallMonitorParams params;
 		params.monitor_h = monitor_h;
 		params.diff = diff;
+		params.timeout_ms = timeout_ms;
 		return syscall(SYSCALL_MONITOR, &params);
 	}
 
@@ -71,9 +104,68 @@ namespace sysapi {
 		SyscallMonitorParams params;
 		params.monitor_h = monitor_h;
 		params.diff = diff;
+		params.timeout_ms = 0;
 		return syscall(SYSCALL_NOTIFY, &params);
 	}
 
+	extern int rwlock_read(int rwlock_h, uint timeout_ms) {
+		SyscallLockParams params;
+		params.lock_h = rwlock_h;
+		params.timeout_ms = timeout_ms;
+		return syscall(SYSCALL_RWLOCK_READ, &params);
+	}
+
+	extern int rwlock_write(int rwlock_h, uint timeout_ms) {
+		SyscallLockParams params;
+		params.lock_h = rwlock_h;
+		params.timeout_ms = timeout_ms;
+		return syscall(SYSCALL_RWLOCK_WRITE, &params);
+	}
+
+	extern int rwlock_unlock(int rwlock_h) {
+		return syscall(SYSCALL_RWLOCK_UNLOCK, (void *) rwlock_h);
+	}
+
+	extern int sem_wait(int sem_h, uint timeout_ms) {
+		SyscallSemParams params;
+		params.sem_h = sem_h;
+		params.count = 0;
+		params.timeout_ms = timeout_ms;
+		return syscall(SYSCALL_SEM_WAIT, &params);
+	}
+
+	extern int sem_post(int sem_h, int count) {
+		SyscallSemParams params;
+		params.sem_h = sem_h;
+		params.count = count;
+		params.timeout_ms = 0;
+		return syscall(SYSCALL_SEM_POST, &params);
+	}
+
+	extern uint wait_any(const int *monitor_hs, uint count, uint timeout_ms) {
+		SyscallWaitAnyParams params;
+		params.monitor_hs = monitor_hs;
+		params.count = count;
+		params.timeout_ms = timeout_ms;
+		return (uint) syscall(SYSCALL_WAIT_ANY, &params);
+	}
+
+	extern int futex_wait(volatile uint *addr, uint expected, uint timeout_ms) {
+		SyscallFutexParams params;
+		params.addr = addr;
+		params.value = expected;
+		params.timeout_ms = timeout_ms;
+		return syscall(SYSCALL_FUTEX_WAIT, &params);
+	}
+
+	extern int futex_wake(volatile uint *addr, uint count) {
+		SyscallFutexParams params;
+		params.addr = addr;
+		params.value = count;
+		params.timeout_ms = 0;
+		return syscall(SYSCALL_FUTEX_WAKE, &params);
+	}
+
 	extern int update_gui() {
 		return syscall(SYSCALL_UPDATE_GUI, nullptr);
 	}
@@ -82,5 +174,9 @@ namespace sysapi {
 		return syscall(SYSCALL_REDRAW_GUI, nullptr);
 	}
 
+	extern int mem_stats(MemStats *stats) {
+		return syscall(SYSCALL_MEM_STATS, stats);
+	}
+
 
 };
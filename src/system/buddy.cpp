@@ -0,0 +1,241 @@
+#include <new>
+#include <std/types.h>
+#include <std/bitops.h>
+#include <devices/cpu.h>
+#include <memory.h>
+#include <buddy.h>
+#include <util/debug.h>
+
+#pragma push_macro("DEBUG_LEVEL")
+
+#define DEBUG_LEVEL 0
+
+// bitmap blocks (32 pages each) per arena
+#define ARENA_BITMAP_BLOCKS (BUDDY_ARENA_PAGES / 32)
+
+BuddyAllocator *buddy_allocator;
+
+static inline uint order_offset(uint order) {
+	return 2048 - (2048 >> order);
+}
+
+BuddyAllocator::BuddyAllocator() {
+	for (int k = 0; k < BUDDY_ORDERS; k++) {
+		order_arenas[k] = 0;
+	}
+	free_slots = (uint) low_ones(BUDDY_MAX_ARENAS);
+	memset(region_arena, 0, sizeof(region_arena));
+}
+
+bool BuddyAllocator::test_block(int a, uint order, uint block) {
+	uint bit = order_offset(order) + block;
+	return (arenas[a].free_bits[bit / 32] >> (bit % 32)) & 1;
+}
+
+void BuddyAllocator::set_block(int a, uint order, uint block) {
+	uint bit = order_offset(order) + block;
+	arenas[a].free_bits[bit / 32] |= (1 << (bit % 32));
+
+	if (arenas[a].free_blocks[order]++ == 0) {
+		order_arenas[order] |= (1 << a);
+	}
+}
+
+void BuddyAllocator::clear_block(int a, uint order, uint block) {
+	uint bit = order_offset(order) + block;
+	arenas[a].free_bits[bit / 32] &= ~(1 << (bit % 32));
+
+	if (--arenas[a].free_blocks[order] == 0) {
+		order_arenas[order] &= ~(1 << a);
+	}
+}
+
+int BuddyAllocator::find_block(int a, uint order) {
+	// returns the index of a free block of `order` in arena `a`, or -1
+	uint first = order_offset(order);
+	uint last = first + (BUDDY_ARENA_PAGES >> order) - 1;
+
+	for (uint w = first / 32; w <= last / 32; w++) {
+		uint bits = arenas[a].free_bits[w];
+
+		// orders above 5 share the last word, mask off the other orders:
+		if (w == first / 32) bits &= ~low_ones(first % 32);
+		if (w == last / 32) bits &= low_ones((last % 32) + 1);
+
+		if (bits) return (w * 32) + bitscan_forward(bits) - first;
+	}
+	return -1;
+}
+
+int BuddyAllocator::acquire_arena() {
+	// borrow 4MB of free pages from `page_allocator`
+	// returns the new arena index, or -1
+
+	if (free_slots == 0) return -1;
+
+	uint groups = page_allocator->max_blocks / ARENA_BITMAP_BLOCKS;
+
+	// from the top down, since `PageMagazine::refill()` packs single frames in from the bottom
+	// region 0 is the kernel's low 4MB
+	for (uint g = groups - 1; g > 0; g--) {
+		uint first_block = g * ARENA_BITMAP_BLOCKS;
+
+		// cheap unlocked check before trying to lock anything
+		int b = 0;
+		for (; b < ARENA_BITMAP_BLOCKS; b++) {
+			if (page_allocator->bitset_blocks[first_block + b] != 0) break;
+		}
+		if (b < ARENA_BITMAP_BLOCKS) continue;
+
+		for (b = 0; b < ARENA_BITMAP_BLOCKS; b++) {
+			uint old_bits = page_allocator->lock_block(first_block + b);
+			if (old_bits != 0) {
+				// lost a race for this block, put it back and undo the rest
+				page_allocator->unlock_block(old_bits, first_block + b);
+				break;
+			}
+		}
+		if (b < ARENA_BITMAP_BLOCKS) {
+			for (int u = 0; u < b; u++) {
+				page_allocator->unlock_block(0, first_block + u);
+			}
+			continue;
+		}
+
+		// the arena's blocks stay all-ones while we own them, clear their hints so bitmap searches skip them
+		for (b = 0; b < ARENA_BITMAP_BLOCKS; b++) {
+			page_allocator->unlock_block(-1, first_block + b);
+		}
+
+		int a = bitscan_forward(free_slots);
+		free_slots &= ~(1 << a);
+
+		BuddyArena *arena = &arenas[a];
+		arena->base_frame = g * BUDDY_ARENA_PAGES;
+		memset(arena->free_bits, 0, sizeof(arena->free_bits));
+		memset(arena->free_blocks, 0, sizeof(arena->free_blocks));
+
+		region_arena[g] = a + 1;
+		set_block(a, BUDDY_MAX_ORDER, 0);
+
+		debug(9, "Buddy arena ", a, " @ frame ", (hex) arena->base_frame);
+		return a;
+	}
+	return -1;
+}
+
+void BuddyAllocator::release_arena(int a) {
+	// give a completely free arena back to `page_allocator`
+	BuddyArena *arena = &arenas[a];
+
+	clear_block(a, BUDDY_MAX_ORDER, 0);
+	region_arena[arena->base_frame / BUDDY_ARENA_PAGES] = 0;
+	free_slots |= (1 << a);
+
+	uint first_block = arena->base_frame / 32;
+	for (int b = 0; b < ARENA_BITMAP_BLOCKS; b++) {
+		page_allocator->unlock_block(0, first_block + b);
+	}
+}
+
+int BuddyAllocator::alloc(uint order) {
+	if (order > BUDDY_MAX_ORDER) return -1;
+
+	uint flags = irq_save();
+	mutex.lock();
+
+	// smallest order with a free block that fits:
+	int a = -1;
+	uint k = order;
+	for (; k <= BUDDY_MAX_ORDER; k++) {
+		if (order_arenas[k]) {
+			a = bitscan_forward(order_arenas[k]);
+			break;
+		}
+	}
+	if (a < 0) {
+		a = acquire_arena();
+		k = BUDDY_MAX_ORDER;
+	}
+	if (a < 0) {
+		mutex.unlock();
+		irq_restore(flags);
+		return -1;
+	}
+
+	uint block = find_block(a, k);
+	clear_block(a, k, block);
+
+	// split down to the requested order, freeing the upper halves:
+	while (k > order) {
+		k--;
+		block <<= 1;
+		set_block(a, k, block + 1);
+	}
+
+	int frame = arenas[a].base_frame + (block << order);
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return frame;
+}
+
+void BuddyAllocator::free(uint frame, uint order) {
+	uint flags = irq_save();
+	mutex.lock();
+
+	int a = region_arena[frame / BUDDY_ARENA_PAGES] - 1;
+	if (a < 0) {
+		debug(0, "Buddy free of unowned frame ", (hex) frame);
+		mutex.unlock();
+		irq_restore(flags);
+		return;
+	}
+
+	uint block = (frame - arenas[a].base_frame) >> order;
+
+	// merge with free buddies as far up as possible:
+	while (order < BUDDY_MAX_ORDER) {
+		uint buddy = block ^ 1;
+		if (!test_block(a, order, buddy)) break;
+
+		clear_block(a, order, buddy);
+		block >>= 1;
+		order++;
+	}
+	set_block(a, order, block);
+
+	// keep one spare arena around so alloc/free cycles don't keep rescanning the bitmap
+	if ((order == BUDDY_MAX_ORDER) && (order_arenas[BUDDY_MAX_ORDER] & ~(1 << a))) {
+		release_arena(a);
+	}
+
+	mutex.unlock();
+	irq_restore(flags);
+}
+
+uint BuddyAllocator::free_pages() {
+	uint flags = irq_save();
+	mutex.lock();
+
+	uint pages = 0;
+	for (uint a = 0; a < BUDDY_MAX_ARENAS; a++) {
+		if (free_slots & (1 << a)) continue;
+		for (uint k = 0; k < BUDDY_ORDERS; k++) {
+			pages += (uint) arenas[a].free_blocks[k] << k;
+		}
+	}
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return pages;
+}
+
+void init_buddy_allocator() {
+	uint pages = (sizeof(BuddyAllocator) + 4095) / 4096;
+	buddy_allocator = new (static_alloc_pages(pages)) BuddyAllocator();
+}
+
+#pragma pop_macro("DEBUG_LEVEL")
@@ -1,11 +1,12 @@
 #include <util/debug.h>
 #include <new>
 #include <events.h>
-#include <std/pool.h>
 #include <memory.h>
+#include <slab.h>
 #include <interrupts.h>
 #include <process.h>
 #include <threads.h>
+#include <scheduler.h>
 #include <std/queue.h>
 #include <devices/vga.h>
 #include <devices/ps2.h>
@@ -63,6 +64,10 @@ struct SubscriberNode {
 
 };
 
+static void construct_subscriber(void *obj) {
+	new (obj) SubscriberNode();
+}
+
 struct SubscriberList {
 	SubscriberNode *head;
 
@@ -197,15 +202,19 @@ struct DisplayWorker: public Worker {
 template <int N=0>
 struct UserEventWorker: public Worker {
 	SharedMsgQueue<N> event_queue;
-	// pool of subscriber nodes to allocate from
-	PoolAllocator<SubscriberNode, MAX_SUBSCRIPTIONS> sub_pool;
+	// subscriber nodes to allocate from
+	SlabCache *sub_cache;
 
 	// list of processes that subscribe to each event type:
 	SubscriberList event_subs[(const int) UserEvents::MAX];
 
+	UserEventWorker() {
+		sub_cache = slab_cache_create("SubscriberNode", sizeof(SubscriberNode), construct_subscriber);
+	}
+
 	int sub_proc_event(Process *proc, UserEvents event) {
 	// subscribe a process to an event type
-		SubscriberNode *node = sub_pool.alloc();
+		SubscriberNode *node = (SubscriberNode *) slab_alloc(sub_cache);
 		if (node == nullptr) return -1;
 		node->proc = proc;
 		event_subs[(int) event].push_head(node);
@@ -348,19 +357,19 @@ int sub_proc_event(Process *proc, UserEvents event) {
 void new_user_event(int msg_id, int data) {
 	Message msg = (struct Message) {msg_id, data};
 	kevents->w_user.event_queue.enqueue(&msg);
-	(*procs[0].msg_signal)++;
+	procs[0].notify(MSG_MONITOR);
 }
 
 void new_callback_event(void (*handler)(int), int data) {
 	Message msg = {(int) handler, data};
 	kevents->w_callback.event_queue.enqueue(&msg);
-	(*procs[0].msg_signal)++;
+	procs[0].notify(MSG_MONITOR);
 }
 
 
 void new_display_msg(DisplayMsg msg) {
 	kevents->w_display.event_queue.enqueue(&msg);
-	(*procs[0].msg_signal)++;
+	procs[0].notify(MSG_MONITOR);
 }
 
 
@@ -380,8 +389,7 @@ void enter_event_loop() {
 
 
 void init_events() {
-	uint kevent_pages = (sizeof(EventSystem) + 4095) / 4096;
-	kevents = new (static_alloc_pages(kevent_pages)) EventSystem();
+	kevents = new EventSystem();
 
 	(*procs[0].msg_signal)=0;
 
@@ -393,7 +401,10 @@ void init_events() {
 	kernelEvents = (KernelThread *) &(procs[0].threads[1]);
 
 	kernelEvents->init((void *) enter_event_loop, stack, stack_bytes);
-	kernelEvents->runState = RUNNING;
+
+	// input and redraws go ahead of every user thread
+	set_thread_priority(kernelEvents, PRIORITY_KERNEL_EVENTS);
+	wake_thread(kernelEvents);
 
 	debug(9, "INITialized kernelEvents");
 
@@ -0,0 +1,26 @@
+#include <std/types.h>
+#include <fastmem.h>
+#include <page.h>
+
+/*
+ No SSE here: the kernel doesn't save FPU/SSE state on a context switch, so turning on CR4.OSFXSR would let user code run SSE instructions whose registers then leak between threads.
+*/
+
+void page_copy(void *dst, const void *src) {
+	uint count = BYTES_PER_PAGE / 4;
+	__asm__ volatile(
+		"cld\n"
+		"rep movsl"
+	:"+D" (dst), "+S" (src), "+c" (count)
+	::"memory");
+}
+
+void page_zero(void *dst) {
+	uint count = BYTES_PER_PAGE / 4;
+	__asm__ volatile(
+		"cld\n"
+		"rep stosl"
+	:"+D" (dst), "+c" (count)
+	:"a" (0)
+	:"memory");
+}
@@ -0,0 +1,121 @@
+#include <std/types.h>
+#include <std/atomic.h>
+#include <util/debug.h>
+#include <devices/cpu.h>
+#include <futex.h>
+#include <process.h>
+#include <threads.h>
+#include <scheduler.h>
+#include <memory.h>
+
+#pragma push_macro("DEBUG_LEVEL")
+
+#define DEBUG_LEVEL 0
+
+struct FutexBucket {
+	SpinLock lock;
+	Thread *head;
+};
+
+static FutexBucket buckets[FUTEX_BUCKETS];
+
+static FutexBucket *bucket_of(Process *proc, volatile uint *addr) {
+	// words are 4-byte aligned, so the low bits don't spread anything
+	uint key = ((uint) addr >> 2) ^ ((proc - procs) * 0x9E3779B1);
+	return &buckets[(key ^ (key >> 16)) % FUTEX_BUCKETS];
+}
+
+static void unlink(FutexBucket *bucket, Thread *thread) {
+	Thread **link = &bucket->head;
+	while ((*link != nullptr) && (*link != thread)) link = &(*link)->futex_next;
+	if (*link != nullptr) *link = thread->futex_next;
+
+	thread->futex_next = nullptr;
+	thread->futex_addr = nullptr;
+}
+
+int futex_wait(Process *proc, volatile uint *addr, uint expected, uint timeout_ms) {
+	Thread *thread = thisThread;
+	FutexBucket *bucket = bucket_of(proc, addr);
+
+	// fault the page in now, not while holding the bucket lock
+	(void) *addr;
+
+	uint flags = irq_save();
+	bucket->lock.lock();
+
+	// compared under the bucket lock, so a `futex_wake()` after the value changed can't slip past us
+	if (*addr != expected) {
+		bucket->lock.unlock();
+		irq_restore(flags);
+		return 0;
+	}
+
+	// append, so waiters are woken in the order they came
+	Thread **link = &bucket->head;
+	while (*link != nullptr) link = &(*link)->futex_next;
+	*link = thread;
+	thread->futex_next = nullptr;
+	thread->futex_addr = addr;
+
+	if (timeout_ms != 0) set_timeout(thread, deadline_after(timeout_ms));
+
+	block_thread(thread);
+
+	bucket->lock.unlock();
+	irq_restore(flags);
+
+	yield();
+
+	if (timeout_ms == 0) return 1;
+
+	cancel_timeout(thread);
+
+	flags = irq_save();
+	bucket->lock.lock();
+
+	// `futex_wake()` takes us off the list, so still being on it means the timeout fired first
+	bool timed_out = (thread->futex_addr != nullptr);
+	if (timed_out) unlink(bucket, thread);
+
+	bucket->lock.unlock();
+	irq_restore(flags);
+
+	return timed_out ? -1 : 1;
+}
+
+int futex_wake(Process *proc, volatile uint *addr, uint count) {
+	FutexBucket *bucket = bucket_of(proc, addr);
+	int woken = 0;
+
+	uint flags = irq_save();
+	bucket->lock.lock();
+
+	Thread *thread = bucket->head;
+	while ((thread != nullptr) && ((uint) woken < count)) {
+		Thread *next = thread->futex_next;
+		if ((thread->futex_addr == addr) && (thread->proc == proc)) {
+			unlink(bucket, thread);
+			wake_thread(thread);
+			woken++;
+		}
+		thread = next;
+	}
+
+	bucket->lock.unlock();
+	irq_restore(flags);
+
+	// hand over straight away if we woke something more urgent than us
+	if (flags & 0x200) preempt_check();
+
+	return woken;
+}
+
+void init_futex() {
+	for (int b = 0; b < FUTEX_BUCKETS; b++) {
+		buckets[b].lock.locked = 0;
+		buckets[b].head = nullptr;
+	}
+}
+
+#pragma pop_macro("DEBUG_LEVEL")
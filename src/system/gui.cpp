@@ -549,11 +549,9 @@ static void generate_cursor_image(ushort (&buf)[POINTER_WIDTH][POINTER_HEIGHT])
 
 void init_gui(int width, int height) {
 
-	uint winmgr_pages = (sizeof(WindowManager) + 4095) / 4096;
-	winmgr = new (static_alloc_pages(winmgr_pages)) WindowManager();
+	winmgr = new WindowManager();
 	
-	uint mp_pages = (sizeof(MousePointer) + 4095) / 4096;
-	mousePointer = new (static_alloc_pages(mp_pages)) MousePointer();
+	mousePointer = new MousePointer();
 
 	mouse.x = width / 4;
 	mouse.y = height / 4;
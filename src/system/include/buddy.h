@@ -0,0 +1,74 @@
+#pragma once
+
+#include <std/types.h>
+#include <std/atomic.h>
+
+/*
+ Buddy allocator for physically contiguous runs of pages.
+
+ A block of order `k` is 2^k naturally aligned physical pages. The largest order is one 4MB "arena", which the buddy allocator borrows from `page_allocator` as 32 empty bitmap blocks and hands back once the whole arena is free again.
+ While an arena is owned by the buddy allocator, all of its bits in `page_allocator` stay locked.
+*/
+
+#define BUDDY_MAX_ORDER   10
+#define BUDDY_ORDERS      (BUDDY_MAX_ORDER + 1)
+#define BUDDY_ARENA_PAGES (1 << BUDDY_MAX_ORDER)
+
+// one bit per arena in `order_arenas` so this can't exceed 32
+#define BUDDY_MAX_ARENAS  32
+
+// free bits for every order of an arena: 1024 + 512 + ... + 1 = 2047 bits
+#define BUDDY_ARENA_WORDS 64
+
+// number of 4MB regions in the 32-bit physical address space
+#define BUDDY_REGIONS     1024
+
+struct BuddyArena {
+	uint base_frame;
+	ushort free_blocks[BUDDY_ORDERS];
+	// bit set = block is free. Order `k` bits start at `2048 - (2048 >> k)`
+	uint free_bits[BUDDY_ARENA_WORDS];
+};
+
+struct BuddyAllocator {
+	SpinLock mutex;
+
+	// bit `a` of `order_arenas[k]` is set if arena `a` has a free block of order `k`
+	uint order_arenas[BUDDY_ORDERS];
+
+	// bit set = arena slot unused
+	uint free_slots;
+
+	// (arena index + 1) for each 4MB region of physical memory, 0 if the buddy allocator doesn't own it
+	uchar region_arena[BUDDY_REGIONS];
+
+	BuddyArena arenas[BUDDY_MAX_ARENAS];
+
+	BuddyAllocator();
+
+	// returns the first frame index of a free block of `order`, or -1
+	int alloc(uint order);
+
+	// return a block that was allocated at `frame`. Any aligned sub-block of an allocation can be freed on its own.
+	void free(uint frame, uint order);
+
+	// pages in free blocks of every arena
+	uint free_pages();
+
+	bool owns(uint frame) {
+		return region_arena[frame / BUDDY_ARENA_PAGES] != 0;
+	}
+
+private:
+	int acquire_arena();
+	void release_arena(int a);
+
+	int find_block(int a, uint order);
+	bool test_block(int a, uint order, uint block);
+	void set_block(int a, uint order, uint block);
+	void clear_block(int a, uint order, uint block);
+};
+
+extern BuddyAllocator *buddy_allocator;
+
+void init_buddy_allocator();
@@ -8,6 +8,17 @@
 #define LAPIC_ADDRESS      0xFEE00000
 #define IOAPIC_ADDRESS     0xFEC00000
 
+// interrupt command register (low word) fields
+#define ICR_FIXED          0x00000000
+#define ICR_INIT           0x00000500
+#define ICR_STARTUP        0x00000600
+#define ICR_PENDING        0x00001000
+#define ICR_ASSERT         0x00004000
+#define ICR_ALL_BUT_SELF   0x000C0000
+
+// local vector table entries
+#define LVT_MASKED         0x00010000
+
 
 // totally fake datatype: a regular 32-bit uint that takes up 128 bits
 struct __attribute__((packed)) reg128 {
@@ -109,8 +120,8 @@ struct __attribute__((packed)) LAPIC {
 
 	}
 	void set_timer_vector(uint vector) volatile {
-		// set one-shot timer mode, handled by given IDT vector
-		lvt_timer = ((uint)lvt_timer & 0xFFF8FF00) | 0x00020000 | vector;
+		// set one-shot timer mode (unmasked), handled by given IDT vector
+		lvt_timer = ((uint)lvt_timer & 0xFFF8FF00) | vector;
 	}
 
 	void set_timer(int timeout) volatile {
@@ -120,6 +131,13 @@ struct __attribute__((packed)) LAPIC {
 		EOI = 1;
 	}
 
+	void send_ipi(uint dest_apic_id, uint command) volatile {
+		// wait for the previous IPI to be delivered, then send `command` (ICR_* bits and a vector)
+		while ((uint) ICR[0] & ICR_PENDING) __asm__ volatile("pause");
+		ICR[1] = dest_apic_id << 24;
+		ICR[0] = command;
+	}
+
 };
 
 struct __attribute__((packed)) IOAPIC {
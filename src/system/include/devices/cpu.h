@@ -5,6 +5,18 @@
 #define cli() __asm__ volatile("cli")
 #define sti() __asm__ volatile("sti")
 
+static inline uint irq_save() {
+	// disable interrupts, returning the previous EFLAGS for `irq_restore()`
+	uint eflags;
+	__asm__ volatile("pushfl\n popl %0\n cli":"=r"(eflags)::"memory");
+	return eflags;
+}
+
+static inline void irq_restore(uint eflags) {
+	// re-enable interrupts only if they were enabled before `irq_save()`
+	if (eflags & 0x200) sti();
+}
+
 static void setPageDirectory(uint pdir) {
 	// Set the page directory location (cr3)
 	__asm__ volatile("mov %0, %%cr3"::"a"(pdir):"memory");
@@ -16,3 +28,42 @@ static void enablePaging() {
 	__asm__ volatile("mov %%cr0, %0":"=r"(cr0)::"memory");
 	__asm__ volatile("mov %0, %%cr0"::"r"(cr0 | 0x80000000):"memory");
 }
+
+// CPUID leaf 1 feature bits (EDX)
+#define CPUID_PSE   (1 << 3)
+#define CPUID_APIC  (1 << 9)
+#define CPUID_PGE   (1 << 13)
+
+#define CR4_PSE         (1 << 4)
+#define CR4_PGE         (1 << 7)
+
+static inline void cpuid(uint leaf, uint *eax, uint *ebx, uint *ecx, uint *edx) {
+	__asm__ volatile("cpuid":"=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx):"a"(leaf), "c"(0));
+}
+
+static inline uint cpuid_features() {
+	// CPUID leaf 1 EDX
+	uint eax, ebx, ecx, edx;
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	return edx;
+}
+
+static inline uint read_cr0() {
+	uint cr0;
+	__asm__ volatile("mov %%cr0, %0":"=r"(cr0)::"memory");
+	return cr0;
+}
+
+static inline void write_cr0(uint cr0) {
+	__asm__ volatile("mov %0, %%cr0"::"r"(cr0):"memory");
+}
+
+static inline uint read_cr4() {
+	uint cr4;
+	__asm__ volatile("mov %%cr4, %0":"=r"(cr4)::"memory");
+	return cr4;
+}
+
+static inline void write_cr4(uint cr4) {
+	__asm__ volatile("mov %0, %%cr4"::"r"(cr4):"memory");
+}
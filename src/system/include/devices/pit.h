@@ -0,0 +1,29 @@
+#pragma once
+
+#include <std/types.h>
+#include <devices/io.h>
+
+// the PIT counts at 1.193182MHz whether or not its IRQ is routed anywhere
+#define PIT_HZ 1193182
+
+static void pit_delay(uint us) {
+	// busy-wait using PIT channel 2 in one-shot mode, up to ~54ms
+	uint count = us * (PIT_HZ / 1000) / 1000;
+	if (count > 0xFFFF) count = 0xFFFF;
+	if (count == 0) count = 1;
+
+	// channel 2 gate off and speaker off while we program it
+	uchar gate = inb(0x61) & ~0x03;
+	outb(0x61, gate);
+
+	// channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+	outb(0x43, 0xB0);
+	outb(0x42, count & 0xFF);
+	outb(0x42, (count >> 8) & 0xFF);
+
+	// raising the gate starts the count, OUT2 (bit 5 of port 0x61) goes high when it reaches 0
+	outb(0x61, gate | 0x01);
+	while ((inb(0x61) & 0x20) == 0) __asm__ volatile("pause");
+
+	outb(0x61, gate);
+}
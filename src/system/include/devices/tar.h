@@ -6,6 +6,7 @@
 #include <devices/storage.h>
 #include <util/debug.h>
 #include <memory.h>
+#include <slab.h>
 #include <filesystem.h>
 
 #define BYTES_PER_SECTOR 512
@@ -136,37 +137,35 @@ debug(9, "EXITING FileSystem::fread()");
 	}
 };
 
+static void construct_tar_file(void *obj) {
+	new (obj) TarFile;
+}
+
 struct TarFS: public FileSystem {
 // TODO file functions are not at all thread safe
 
-	TarFile *files;
-	uint max_files;
+	SlabCache *files;
 
 	uint root_sector;
 	SectorDevice *sd;
 
 	TarFS(SectorDevice *source) {
-		max_files = 0x10;
 		sd = source;
 		root_sector = 1; // LBA sector 0 is the boot sector, 1 is the start of Tar header
 
-		uint tf_size = (sizeof(TarFile) * max_files);
-		files = (TarFile *) static_alloc_pages((tf_size + 4095) / 4096);
-		for (int f = 0; f < max_files; f++) {
-			new (&files[f]) TarFile;
-			files[f].init(sd);
-		}
-
+		files = slab_cache_create("TarFile", sizeof(TarFile), construct_tar_file);
 	}
 
 	TarFile *alloc_file(){
-		for (int i = 0; i < max_files; i++) {
-			if (files[i].size == 0) return &files[i];
-		}
-		return nullptr;
+		TarFile *file = (TarFile *) slab_alloc(files);
+		if (file == nullptr) return nullptr;
+
+		file->init(sd);
+		file->size = 0;
+		return file;
 	}	
 	void free_file(TarFile *file) {
-		file->init(sd);
+		slab_free(file);
 	}
 
 	//Find the starting sector for a file by name, also fills in the header
@@ -423,6 +423,9 @@ static int elf_exec(const char *name) {
 
 	debug(9, "program headers @ ",  (hex) &executable.phdrs);
 
+	// end of the last page mapped so far; LOAD segments are sorted by address but can share a page
+	uint mapped_end = 0;
+
 	//Map all LOAD segments into virtual memory:
 	for (int i = 0; i < header->e_phnum; i++) {
 
@@ -433,10 +436,16 @@ static int elf_exec(const char *name) {
 			uint size = (uint) executable.phdrs[i].p_filesz;
 
 			debug(9, "LOAD Segment @ offset ", (hex) offset, ", v.addr = ", (hex) voffset, ", size = ", (hex) size);
-			uint pages = ((voffset & 0xFFF) + size + BYTES_PER_PAGE - 1) / BYTES_PER_PAGE;
-			void *vaddr = (void *)(voffset & 0xFFFFF000);
+			uint seg_start = voffset & 0xFFFFF000;
+			uint seg_end = (voffset + executable.phdrs[i].p_memsz + BYTES_PER_PAGE - 1) & 0xFFFFF000;
+
+			// don't ask for a page the previous segment already has
+			if (seg_start < mapped_end) seg_start = mapped_end;
 
-			sysapi::alloc_at(pages, vaddr);
+			if (seg_end > seg_start) {
+				sysapi::alloc_at((seg_end - seg_start) / BYTES_PER_PAGE, (void *) seg_start);
+				mapped_end = seg_end;
+			}
 
 			sysapi::seek(filehandle, offset);
 
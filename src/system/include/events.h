@@ -9,7 +9,6 @@
 
 #define MAX_EVENTS 16
 #define MAX_WORKERS 8
-#define MAX_SUBSCRIPTIONS 64
 
 
 enum class DisplayEvents {
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <std/types.h>
+
+/*
+ Whole-page copy and clear with `rep movsl`/`rep stosl`.
+ Both pointers must be page aligned.
+*/
+
+void page_copy(void *dst, const void *src);
+void page_zero(void *dst);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <std/types.h>
+#include <process.h>
+
+/*
+ Wait queues for user-space locks (see sync.h). Threads wait on a word in their process's memory, and the kernel only keeps track of who's waiting on what.
+ Waiters live in a hash table keyed by process and address, each bucket a list behind its own spinlock.
+*/
+#define FUTEX_BUCKETS 64
+
+// block the current thread until `futex_wake()` on `addr`, unless *addr != `expected` when we look
+// returns 1 when woken, 0 if the value had already changed, -1 if `timeout_ms` (0 = forever) ran out
+int futex_wait(Process *proc, volatile uint *addr, uint expected, uint timeout_ms);
+
+// wake up to `count` threads waiting on `addr`, returns how many were woken
+int futex_wake(Process *proc, volatile uint *addr, uint count);
+
+void init_futex();
@@ -5,6 +5,7 @@
 #include <std/types.h>
 #include <process.h>
 #include <memory.h>
+#include <kmalloc.h>
 #include <gui/objects.h>
 
 #define POINTER_WIDTH 16
@@ -104,8 +105,7 @@ struct WindowManager {
 
 	WindowManager() {
 
-		uint pick_buf_pages = (VGA_WIDTH * VGA_HEIGHT + 4095) / 4096;
-		pick_buffer = (uchar *) static_alloc_pages(pick_buf_pages);
+		pick_buffer = (uchar *) kmalloc(VGA_WIDTH * VGA_HEIGHT);
 
 	}
 	GUIWindow *getGUIWindow(int index) {
@@ -3,11 +3,14 @@
 #include <std/types.h>
 #include <util/debug.h>
 #include <threads.h>
+#include <percpu.h>
 
 
-extern void *interrupt_stack;
-
 #define INTERRUPT_DECLARATION(NAME) void __attribute__((naked)) NAME() 
+/*
+ %gs is reloaded first, then `thisThread` and this CPU's interrupt stack are found through it.
+ `cpuState` is the first member of `Thread`, so `thisThread->cpuState` is at offset 0 of whatever `PerCPU::thread` points at.
+*/
 #define INTERRUPT_DEFINITION(NAME) \
 void __attribute__((naked)) NAME() {\
 	__asm__ volatile(\
@@ -17,15 +20,20 @@ void __attribute__((naked)) NAME() {\
 		"movw %dx, %es\n"\
 	);\
 	__asm__ volatile(\
-		"movl %%esp, %[thisThreadState]\n"\
+		"movw %[percpu], %%dx\n"\
+		"movw %%dx, %%gs\n"\
+		"movl %%gs:%c[thread], %%eax\n"\
+		"movl %%esp, (%%eax)\n"\
 		/* TODO: this resets esp to interrupt_stack every time, so if ints were to nest they'd corrupt the stack.*/\
-		"movl %[interruptStack], %%esp\n"\
+		"movl %%gs:%c[interruptStack], %%esp\n"\
 		"calll " #NAME "_inner\n"\
-	::[thisThreadState] "m"(thisThread->cpuState), [interruptStack] "m" (interrupt_stack));\
-	/* Separate asm statement to force `thisThreadState` to be reloaded:*/\
+		"calll interrupt_exit\n"\
+	::[percpu] "i"(PERCPU_SELECTOR), [thread] "i"(__builtin_offsetof(PerCPU, thread)), [interruptStack] "i"(__builtin_offsetof(PerCPU, interrupt_stack)));\
+	/* Separate asm statement to force `thisThread` to be reloaded:*/\
 	__asm__ volatile(\
-		/* `thisThreadState` may have been modified inside the handler function above */\
-		"movl %[thisThreadState], %%esp\n"\
+		/* `thisThread` and its `cpuState` may have been modified inside the handler function above */\
+		"movl %%gs:%c[thread], %%eax\n"\
+		"movl (%%eax), %%esp\n"\
 		"cmpl $0x1b, 0x24(%%esp)\n"\
 		"jne over_fix_ds_" #NAME "\n"\
 		"movw $0x23, %%dx\n"\
@@ -34,10 +42,13 @@ void __attribute__((naked)) NAME() {\
 		"over_fix_ds_" #NAME ":\n"\
 		"popal\n"\
 		"iret\n"\
-	:: [thisThreadState] "m" (thisThread->cpuState));\
+	:: [thread] "i"(__builtin_offsetof(PerCPU, thread)));\
 }\
 extern "C" void NAME ## _inner()
 
+// scheduler.cpp: switches threads on the way out of an interrupt if a wake-up asked for it
+extern "C" void interrupt_exit();
+
 
 
 struct InterruptDescriptor {
@@ -83,6 +94,9 @@ struct __attribute__((packed)) IDTR {
 
 void init_interrupts();
 
+// point this CPU at the shared IDT
+void load_idt();
+
 // global IDT is defined in kernel.cpp
 extern IDT *idt;
 
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <std/types.h>
+
+/*
+ General-purpose kernel heap, in the kernel window so it is mapped in every address space.
+
+ Small sizes are rounded up to a power-of-two size class, each served by a slab cache.
+ Anything bigger than the largest class gets whole pages of its own from `virt_alloc_pages()`.
+ `kfree()` tells the two apart by address: slab pages all live below KERNEL_VM_BASE.
+*/
+
+// size classes are 2^KMALLOC_MIN_SHIFT .. 2^KMALLOC_MAX_SHIFT bytes
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_CLASSES   (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// returns nullptr on failure
+void *kmalloc(uint size);
+void kfree(void *ptr);
+
+void init_kmalloc();
@@ -2,21 +2,130 @@
 
 #include <threads.h>
 
+/*
+ Kernel wait queues and the locks built on them.
+
+ A `WaitQueue` is a FIFO of blocked threads linked through `Thread::wait_next`/`wait_prev`, so queueing, waking and leaving one on a timeout are all O(1).
+ Every queue is guarded by one spinlock in locks.cpp, taken with interrupts disabled since interrupt handlers and other CPUs wake threads too.
+
+ `Lock` is a mutex that `lock_release()` hands straight to its first waiter. While threads wait on it, its owner runs at the most urgent of their priorities (priority inheritance), so a low-priority owner can't hold up the event thread behind everything else that's runnable.
+ `CondVar` gives up a lock while it waits and takes it back before returning. `Semaphore` counts, and `sem_post()` hands its units straight to the threads it wakes.
+ `RWLock` lets any number of readers in at once but prefers writers: once a writer waits, new readers queue behind it.
+
+ `monitor_wait_any()` watches several monitors at once. It hangs a `MonitorPoll` off each one, all pointing at a wait queue of its own, and whichever monitor is notified first takes the thread off that queue.
+
+ A non-zero `deadline` (a TSC value, see `deadline_after()`) bounds a wait, which returns false if it passes first.
+*/
+
+struct Lock;
+
+struct WaitQueue {
+	Thread *head;
+	Thread *tail;
+
+	void init();
+
+	bool empty() {
+		return head == nullptr;
+	}
+
+	void push(Thread *thread);
+	void remove(Thread *thread);
+
+	// take the thread that's waited longest, nullptr if there's none
+	Thread *pop();
+};
+
 struct Lock {
 	Thread *owner;
-	Thread *next;
+	WaitQueue waiters;
+
+	// the next lock `owner` holds, see `Thread::held_locks`
+	Lock *held_next;
+
+	void init();
+};
+
+struct CondVar {
+	WaitQueue waiters;
+
+	void init();
+};
+
+struct Semaphore {
+	int count;
+	WaitQueue waiters;
 
+	void init(int count=0);
+};
+
+struct RWLock {
+	// active readers, or the writer, never both
+	int readers;
+	Thread *writer;
+	WaitQueue read_waiters;
+	WaitQueue write_waiters;
+
+	void init();
+};
+
+struct MonitorPoll {
+	// the polling thread's private queue, see `monitor_wait_any()`
+	WaitQueue *queue;
+	MonitorPoll *next;
+	MonitorPoll *prev;
 };
 
 struct Monitor {
 	Lock lock;
+	CondVar signalled;
 	int signal;
+
+	// threads in `monitor_wait_any()` on this monitor
+	MonitorPoll *pollers;
+
+	void init();
 };
 
+// the owner may take a lock again, a single `lock_release()` frees it
+bool lock_acquire(Lock *lock, unsigned long long deadline=0);
+
+// does nothing unless the current thread owns `lock`
+void lock_release(Lock *lock);
+
+// `lock` must be held, and is held again on return even if the wait timed out
+bool cond_wait(CondVar *cond, Lock *lock, unsigned long long deadline=0);
+
+// wake up to `count` waiters, `boost` as for `wake_thread()`
+void cond_signal(CondVar *cond, uint count=1, bool boost=false);
+void cond_broadcast(CondVar *cond);
+
+bool sem_wait(Semaphore *sem, unsigned long long deadline=0);
+void sem_post(Semaphore *sem, int count=1);
+
+// also fails straight away if the thread already has MAX_READ_HOLDS read holds
+bool rwlock_read(RWLock *rwlock, unsigned long long deadline=0);
+bool rwlock_write(RWLock *rwlock, unsigned long long deadline=0);
+
+// releases whichever side the current thread holds, does nothing if it holds neither
+void rwlock_release(RWLock *rwlock);
+
+// take `mon->lock` and wait for a positive signal, then subtract up to `diff` from it. Keeps the lock unless it returns false
+bool monitor_enter(Monitor *mon, int diff=1, unsigned long long deadline=0);
+
+// add `diff` to the signal and wake that many waiters, boosted since they're usually waiting on input
+void monitor_notify(Monitor *mon, int diff=1);
+
+// wait until any of `mons` has a positive signal, without taking its lock or touching the signal
+// returns a mask with bit `i` set for each ready `mons[i]`, 0 if `deadline` passed first. `count` is at most MAX_WAIT_ANY
+uint monitor_wait_any(Monitor **mons, uint count, unsigned long long deadline=0);
+
+void init_locks();
+
 
 void notify(int monitor_h, int diff=1);
 
-void monitor(int monitor_h, int diff=1);
+// false if `timeout_ms` (0 = forever) ran out first
+bool monitor(int monitor_h, int diff=1, uint timeout_ms=0);
 
 void unmonitor(int monitor_h);
-
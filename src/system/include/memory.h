@@ -11,20 +11,84 @@ i.e. that page table maps the entire array of page tables into a contiguous 4MB
 */
 #define PDIR_SELF_INDEX 1
 
+/*
+ Kernel-only virtual memory that is the same in every address space.
+ Its page tables are all created at boot and marked global, so every process copies them in `new_user_process()`.
+ The first part holds slab pages (see slab.cpp); `virt_alloc_pages()` without PAGE_USER allocates from the rest.
+*/
+#define KERNEL_VIRT_BASE   0xD0000000
+#define KERNEL_VM_BASE     0xD8000000
+#define KERNEL_VIRT_LIMIT  0xE0000000
+
+// each process allocates its own pages between the page table array and the kernel window
+#define USER_VIRT_BASE     ((PDIR_SELF_INDEX + 1) << 22)
+#define USER_VIRT_LIMIT    KERNEL_VIRT_BASE
+
 
 // This is a 4MB flattened-out array of all the page tables
 extern PageTable *page_tables;
 // ptr to the page directory itself, could be one of the page tables
 extern PageTable *page_dir;
-//extern uint virt_alloc_ptr;
 
 extern uint static_alloc_ptr;
 extern uint static_alloc_limit;
 
 extern BitAllocator<> *page_allocator;
 
+// BIOS memory map entry, as collected in boot_stub.nasm
+struct E820Entry {
+	unsigned long long base;
+	unsigned long long length;
+	uint type;
+	uint acpi;
+} __attribute__((packed));
+
+#define E820_USABLE 1
+
+extern E820Entry memMap[];
+extern uint memMapSize;
+
+// per-CPU stack of free frames reserved from `page_allocator`, so single-page allocations don't touch the shared bitmap
+#define MAGAZINE_SIZE  64
+#define MAGAZINE_BATCH 32
+
+struct PageMagazine {
+	uint count;
+	uint frames[MAGAZINE_SIZE];
+
+	void refill();
+	void drain();
+};
+
+// physically contiguous pages, aligned to the next power of two
 void *phys_alloc_pages(uint pages);
 void *phys_alloc_page(void);
+
+// a frame that is already all zeros, from the idle thread's pool when it has one
+void *phys_alloc_zeroed_page(void);
+
+// called from the idle thread, zeroes free frames until this CPU's pool is full
+// once `phys_alloc_page()` has found the page bitmap empty it gives the pool back instead, until frames are plentiful again
+void refill_zero_pool(void);
+
+void phys_free_pages(void *p_addr, uint pages);
+void phys_free_page(void *p_addr);
+
+// frames that could still be allocated, a snapshot for statistics
+uint count_free_frames(void);
+
+/*
+ One byte per physical frame, counting the mappings of it.
+ Allocated frames start at 1 and go back to the allocator when `page_unref()` drops them to 0.
+ Frames at 0 were never counted (static or device memory) and are left alone; counts that reach PAGE_REF_PINNED stay there.
+*/
+#define PAGE_REF_PINNED 0xFF
+
+extern volatile uchar *page_refs;
+
+void page_ref(void *p_addr);
+void page_unref(void *p_addr);
+uint page_refcount(void *p_addr);
 	
 //allocate a number of virtual pages at a specific address with given attributes
 void *virt_alloc_pages(uint pages, void *address, uint attributes);
@@ -41,19 +105,76 @@ void *virt_alloc_page(uint attributes);
 void *virt_alloc_page(void);
 
 
+// reserve virtual pages in the current process (or the kernel window) without mapping them
 void *next_virtual_pages(uint pages);
 void *next_virtual_page(void);
 
+void *next_kernel_pages(uint pages);
+
+// unmap pages and return their frames to the physical allocator
+void virt_free_pages(void *vaddr, uint pages);
+void virt_free_page(void *vaddr);
+
+// free an allocation made by `virt_alloc_pages()` and give its addresses back for reuse
+// returns the number of pages released, 0 if nothing was allocated at `vaddr`
+uint virt_release(void *vaddr);
+
+/*
+ Pending TLB invalidations for a batch of page table changes.
+ Changes are recorded with `add()` and applied once by `flush()`: one `invlpg` per page for small batches, a full TLB flush when more than TLB_FLUSH_MAX pages changed.
+*/
+#define TLB_FLUSH_MAX 32
+
+struct TLBFlush {
+	uint count;
+	// a global mapping changed, so a full flush has to clear CR4.PGE as well as reload CR3
+	bool global;
+	void *pages[TLB_FLUSH_MAX];
+
+	TLBFlush() {
+		count = 0;
+		global = false;
+	}
+
+	void add(void *vaddr, PageMapEntry old);
+	void flush();
+};
 
+// remove a single mapping, returns the physical address it had (or nullptr)
+void *unmap(void *vaddr);
+void *unmap(void *vaddr, TLBFlush *tlb);
+
+// replace whatever is mapped at `vaddr`, recording the change in `tlb` if there was a mapping before
+// returns nullptr if `vaddr` needed a page table and there was no frame for one
+void *remap(void *vaddr, void *p_addr, uint attributes, TLBFlush *tlb);
+
+/*
+ Temporary per-CPU mappings for frames that aren't mapped anywhere we can see.
+ Interrupts must stay disabled from `kmap()` to `kunmap()`, nothing else on this CPU can use the slot in between.
+*/
+#define KMAP_COPY 0
+#define KMAP_ZERO 1
+#define KMAP_SLOTS 2
+
+void *kmap(uint slot, void *p_addr);
+void kunmap(uint slot);
+
+
+// nullptr on failure, as for `remap()`
 void *map_to(void *vaddr, void *p_addr, uint attributes);
 void *map_to(void *vaddr, void *p_addr);
 
+// map a whole 4MB page with one PDE, both addresses must be 4MB aligned
+// returns nullptr if the CPU has no PSE
+void *map_large(void *vaddr, void *p_addr, uint attributes);
+
 uint get_pde_index(void *vaddr);
 uint get_pte_index(void *vaddr);
 
 extern PageMapEntry *get_pte(void *addr);
 extern PageMapEntry *get_pde(void *addr);
 
+// nullptr if a page table was needed and there was no frame for one
 PageMapEntry *ensure_pte(void *vaddr, uint attributes=PAGE_KERNEL_DATA);
 
 
@@ -61,7 +182,12 @@ void *get_physical(void *vaddr);
 
 void *static_alloc_pages(uint pages);
 
-int initialize_memory(void *phys_base_free);
+int initialize_memory(void *phys_base_free, E820Entry *memmap, uint memmap_entries);
+
+#ifdef BENCHMARK_TLB
+// prints the cost of a CR3 reload with and without CR4.PGE, build with -DBENCHMARK_TLB
+void benchmark_tlb();
+#endif
 
 
 
@@ -11,11 +11,14 @@
 #define PAGE_ACCESSED      32
 #define PAGE_LARGE         128
 #define PAGE_GLOBAL        256
+// OS-available bit: not present yet, but reserved. The page fault handler maps a zeroed frame on first touch
+#define PAGE_DEMAND        512
 
 #define PAGE_KERNEL_DATA          (PAGE_WRITE | PAGE_PRESENT)
 #define PAGE_GLOBAL_DATA          (PAGE_GLOBAL | PAGE_WRITE | PAGE_PRESENT)
 #define PAGE_GLOBAL_RO            (PAGE_GLOBAL | PAGE_PRESENT)
 #define PAGE_USER_DATA            (PAGE_USER | PAGE_WRITE | PAGE_PRESENT)
+#define PAGE_USER_LAZY            (PAGE_USER_DATA | PAGE_DEMAND)
 
 // Mark a page as PAGE_COW to make it copy on write
 #define PAGE_COW                  (PAGE_CACHEDISABLED | PAGE_USER | PAGE_PRESENT)
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <std/types.h>
+#include <memory.h>
+
+#define MAX_CPUS 8
+
+/*
+ Every CPU loads its own copy of the GDT. The selectors are the same everywhere, but the TSS and %gs descriptors point at that CPU's `TSS` and `PerCPU`, so kernel code finds its own CPU's state with a %gs-relative load.
+ Interrupt and syscall entry reload %gs, since user mode can't be trusted to leave it alone.
+*/
+#define GDT_ENTRIES     8
+#define TSS_SELECTOR    0x28
+#define PERCPU_SELECTOR 0x38
+
+struct Thread;
+struct Process;
+struct TSS;
+
+struct PerCPU {
+// state that each CPU keeps to itself
+	// must be first, `this_cpu()` reads it through %gs
+	PerCPU *self;
+	uint id;
+
+	// what this CPU is running, see the `thisThread`, `thisProc` and `proc_id` macros below
+	Thread *thread;
+	Process *proc;
+	uint pid;
+
+	// runs when the run queues have nothing for this CPU
+	Thread *idle_thread;
+
+	// a thread more urgent than `thread` was woken for this CPU, see `preempt_check()`
+	volatile bool need_resched;
+	uint apic_id;
+
+	// LAPIC timer counts left of `thread`'s slice when the timer was cut short for a deadline
+	uint slice_left;
+
+	// where interrupt handlers run, see INTERRUPT_DEFINITION
+	void *interrupt_stack;
+
+	// ESP0 for interrupts from ring 3
+	volatile TSS *tss;
+
+	// `sysenter` lands on `syscall_entry_stack`, then `enter_kernel()` moves to `syscall_esp`, the running user thread's own syscall stack
+	void *syscall_entry_stack;
+	uint syscall_esp;
+
+	unsigned long long gdt[GDT_ENTRIES];
+
+	// free frames for `phys_alloc_page()`
+	PageMagazine page_cache;
+
+	// frames already zeroed by the idle thread, for `phys_alloc_zeroed_page()`
+	PageMagazine zero_pool;
+
+	// KMAP_SLOTS pages of kernel window for `kmap()`
+	PageFrame *kmap_slots;
+};
+
+extern PerCPU *cpus;
+
+// bit `c` is set once cpus[c] has started scheduling, the BSP is always cpus[0]
+extern volatile uint cpus_online;
+
+static inline PerCPU *this_cpu() {
+	// volatile: a preempted thread can resume on another CPU
+	PerCPU *cpu;
+	__asm__ volatile("movl %%gs:0, %0":"=r"(cpu));
+	return cpu;
+}
+
+#define thisThread (this_cpu()->thread)
+#define thisProc   (this_cpu()->proc)
+#define proc_id    (this_cpu()->pid)
+
+void init_percpu();
+
+// load `cpu`'s GDT, %gs and task register on the calling CPU
+void load_percpu(PerCPU *cpu);
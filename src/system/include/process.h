@@ -6,24 +6,34 @@
 #include <std/file.h>
 #include <std/env.h>
 #include <std/events.h>
+#include <vmspace.h>
+#include <percpu.h>
+#include <system.h>
 
 #define MAX_PROC_LOCKS    64
 #define MAX_PROC_MONITORS 64
+#define MAX_PROC_RWLOCKS    16
+#define MAX_PROC_SEMAPHORES 16
+
+// stacks kept from exited threads, beyond these they go back to the page allocator
+#define MAX_CACHED_STACKS 4
 
 #define MAX_PROC_THREADS 16
+static_assert(MAX_PROC_THREADS <= MAX_ENV_THREADS, "every thread needs a slot in Environment::thread_stacks");
 #define MAX_PROCS        16
 
 
 struct Process {
 // process control block
 	uint cr3;
-	uint thread_index;
 	uint num_running_threads;
 
 	File *files[MAX_PROC_FILES];
 
 	Lock locks[MAX_PROC_LOCKS];
 	Monitor monitors[MAX_PROC_MONITORS];
+	RWLock rwlocks[MAX_PROC_RWLOCKS];
+	Semaphore semaphores[MAX_PROC_SEMAPHORES];
 
 	// cached ptrs to lock & signal of msg monitor
 	Lock *msg_lock;
@@ -31,36 +41,64 @@ struct Process {
 
 	UserThread threads[MAX_PROC_THREADS];	
 
+	// guards thread slots and `stack_cache`, `thread_exited` is broadcast whenever one of our threads exits
+	Lock thread_lock;
+	CondVar thread_exited;
+
+	// default-sized user stacks and syscall stacks of joined threads, for `new_user_thread()` to reuse
+	struct {
+		void *stacks[MAX_CACHED_STACKS];
+		uint num_stacks;
+		void *syscall_stacks[MAX_CACHED_STACKS];
+		uint num_syscall_stacks;
+	} stack_cache;
+
 	// global kernel-space address for environment:
 	Environment *env;
 
 	// user-space address for environment:
 	Environment *userEnv;
 
-	void lock(Lock *lock);
+	// which user addresses are allocated
+	VMSpace vm;
+
+	// see SYSCALL_MEM_STATS
+	MemStats mem_stats;
+
+	// `timeout_ms` 0 waits forever, otherwise these return false if it runs out first
+	bool lock(Lock *lock, uint timeout_ms=0);
+	bool lock_until(Lock *lock, unsigned long long deadline);
 	void unlock(Lock *lock);
 
 	void send_msg(Message *msg);
 
-	void monitor(int monitor_h, int diff=1);
+	bool monitor(int monitor_h, int diff=1, uint timeout_ms=0);
 	void unmonitor(int monitor_h);
 	void notify(int monitor_h, int diff=1);
+	// see `monitor_wait_any()`, `count` is at most MAX_WAIT_ANY
+	uint wait_any(const int *monitor_hs, uint count, uint timeout_ms=0);
 
+	// handles come straight from user space, so a negative one mustn't index before the array
 	Lock *get_lock(int l_h) {
-		return &locks[l_h % MAX_PROC_LOCKS];
+		return &locks[(uint) l_h % MAX_PROC_LOCKS];
 	}
 
 	Monitor *get_monitor(int m_h) {
-		return &monitors[m_h % MAX_PROC_MONITORS];
+		return &monitors[(uint) m_h % MAX_PROC_MONITORS];
+	}
+
+	RWLock *get_rwlock(int rw_h) {
+		return &rwlocks[(uint) rw_h % MAX_PROC_RWLOCKS];
+	}
+
+	Semaphore *get_semaphore(int s_h) {
+		return &semaphores[(uint) s_h % MAX_PROC_SEMAPHORES];
 	}
 
 };
 
-extern volatile uint proc_id;
 extern uint num_procs;
-extern Process *thisProc;
 extern Process *procs;
-extern volatile TSS *tss;
 
 void init_processes();
 Process *new_user_process();
@@ -1,6 +1,130 @@
 #pragma once
+#include <std/atomic.h>
 #include <interrupts.h>
+#include <percpu.h>
+#include <threads.h>
+
+/*
+ Runnable threads wait in one FIFO per priority level, level 0 being the most urgent.
+ Bit `p` of `RunQueue::ready` is set while level `p` has threads, so picking the next thread is a single `bitscan_forward`.
+ The thread that's currently running isn't in the queue; the timer puts it back at the tail of its level if it's still RUNNING.
+
+ Each CPU has its own queue, and `Thread::cpu` says which one a thread belongs to. A CPU with nothing to run steals from the others, except for kernel threads (procs[0]) which stay on the CPU they started on.
+ A queue's `mutex` covers its levels and the `runState`, `on_cpu`, `cpu` and `priority` of every thread that belongs to it.
+*/
+#define NUM_PRIORITIES   32
+#define PRIORITY_DEFAULT 16
+
+// levels below PRIORITY_USER_MAX are reserved for kernel threads
+#define PRIORITY_USER_MAX      8
+#define PRIORITY_KERNEL_EVENTS 4
+
+// how many levels a thread jumps when woken by `Process::notify()`, it drops back one level per full timeslice
+#define PRIORITY_BOOST 4
+
+// LAPIC timer counts per timeslice: urgent levels get short slices so they come around often, the least urgent run longest
+#define TIMESLICE_BASE 0x4000
+
+static inline uint timeslice(uint priority) {
+	return TIMESLICE_BASE * (1 + priority / 8);
+}
+
+struct ThreadList {
+	Thread *head;
+	Thread *tail;
+};
+
+struct RunQueue {
+	SpinLock mutex;
+	uint ready;
+	ThreadList levels[NUM_PRIORITIES];
+
+	void init();
+
+	// both do nothing if `thread` is already (or isn't) queued
+	void enqueue(Thread *thread);
+	void remove(Thread *thread);
+
+	// take the first thread of the most urgent level, or nullptr if there's none
+	Thread *pop();
+
+	// like `pop()`, but only threads that may move to another CPU
+	Thread *steal();
+};
+
+extern RunQueue run_queues[MAX_CPUS];
+
+/*
+ Pending timeouts, a min-heap on `Thread::deadline` per CPU.
+ The LAPIC timer runs one-shot: each switch arms it for the end of the new thread's slice or the first deadline, whichever is sooner, and an idle CPU with no deadlines doesn't arm it at all.
+ Deadlines are TSC values. `lock` is taken before any run queue's `mutex`, never after.
+*/
+struct TimerHeap {
+	SpinLock lock;
+	Thread **slots;
+	uint count;
+
+	void init(Thread **storage);
+	void insert(Thread *thread);
+	void remove(Thread *thread);
+
+	// LAPIC timer counts until the first deadline (at least 1), 0 if there's none
+	uint counts_to_next();
+
+private:
+	void place(Thread *thread, uint slot);
+	void sift_up(uint slot);
+	void sift_down(uint slot);
+};
+
+extern TimerHeap timer_heaps[MAX_CPUS];
+
+void init_run_queues();
+
+// these change `runState` and keep the run queues in step, callers don't need to hold any queue lock
+
+// RUNNING and queued, unless it's already running
+// `boost` moves it PRIORITY_BOOST levels up (within its class) for a while, for threads woken by input
+void wake_thread(Thread *thread, bool boost=false);
+
+// WAITING and off the queue, it won't be picked until `wake_thread()`
+void block_thread(Thread *thread);
+
+// DONE and off the queue for good, see `exit_thread()`
+void finish_thread(Thread *thread);
+
+// change the static priority, requeueing the thread if it's waiting to run
+void set_thread_priority(Thread *thread, uint priority);
+
+// run `thread` at least as urgently as `priority` until it's called again, NUM_PRIORITIES for none. See locks.h
+void inherit_priority(Thread *thread, uint priority);
+
+// switch to the next runnable thread right away instead of at the next tick
+// returns once this thread is picked again, straight away if it's still the most urgent one
+void schedule();
+
+// `wake_thread()` sets `need_resched` when the woken thread should preempt the one running on its CPU
+// interrupts switch on their way out, other callers use this once they've re-enabled interrupts
+void preempt_check();
+
+// TSC value `ms` milliseconds from now
+unsigned long long deadline_after(uint ms);
+
+// TSC cycles per millisecond, user processes get a copy in their `Environment`
+extern uint tsc_per_ms;
+
+// wake `thread` at `deadline` with `timed_out` set, unless `cancel_timeout()` gets there first
+// for a thread that's about to block: the timer is re-armed when its CPU switches away from it
+void set_timeout(Thread *thread, unsigned long long deadline);
+
+// false if the timeout already fired (and woke the thread)
+bool cancel_timeout(Thread *thread);
+
+// block the current thread for `ms` milliseconds
+void sleep_thread(uint ms);
 
 INTERRUPT_DECLARATION (timer_interrupt);
 void init_scheduler();
 
+// point the calling CPU's LAPIC timer at the scheduler, every CPU does this once
+void start_cpu_timer();
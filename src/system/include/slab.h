@@ -0,0 +1,74 @@
+#pragma once
+
+#include <std/types.h>
+#include <std/atomic.h>
+
+/*
+ Slab allocator for fixed-size kernel objects.
+
+ Each slab is one kernel page: a `Slab` header followed by as many objects as fit.
+ The slab for any object is found by rounding its address down to the page, so objects need no header of their own.
+ Caches are keyed by (rounded) object size and constructor, so asking twice for the same kind of object shares one cache.
+*/
+
+#define SLAB_ALIGN      8
+
+// fully free slabs each cache keeps before giving pages back
+#define SLAB_MAX_EMPTY  2
+
+struct SlabCache;
+
+struct Slab {
+	SlabCache *cache;
+	Slab *next;
+	Slab *prev;
+
+	// free objects, linked through their first word
+	void *free_list;
+	uint in_use;
+};
+
+struct SlabList {
+	Slab *head;
+
+	void push(Slab *slab);
+	void remove(Slab *slab);
+};
+
+struct SlabCache {
+	const char *name;
+	uint obj_size;
+	uint objs_per_slab;
+	uint first_offset;
+
+	// called on each object as it is handed out by `alloc()`
+	void (*ctor)(void *obj);
+
+	SpinLock mutex;
+
+	SlabList partial;
+	SlabList full;
+	SlabList empty;
+	uint num_empty;
+
+	// all caches are chained together for `slab_cache_create()` lookups
+	SlabCache *next;
+
+	void init(const char *name, uint size, void (*ctor)(void *));
+
+	void *alloc();
+	void free(void *obj);
+
+private:
+	Slab *grow();
+};
+
+// largest object that fits in a single-page slab
+#define SLAB_MAX_OBJ_SIZE (4096 - ((sizeof(Slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1)))
+
+SlabCache *slab_cache_create(const char *name, uint size, void (*ctor)(void *)=nullptr);
+
+void *slab_alloc(SlabCache *cache);
+void slab_free(void *obj);
+
+void init_slab();
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <std/types.h>
+#include <percpu.h>
+
+/*
+ The BSP starts the other CPUs (APs) by broadcasting INIT and startup IPIs, there's no ACPI/MP table parsing to find them one by one.
+ Each AP runs the trampoline in ap_boot.nasm, then `ap_main()` loads its own GDT, IDT and LAPIC timer and joins in scheduling from its idle loop.
+*/
+
+// startup IPIs can only point at a page below 1MB
+#define AP_TRAMPOLINE 0x1000
+
+// each AP's boot stack, which then belongs to its idle thread
+#define AP_STACK_PAGES 4
+
+// asks the other CPUs to flush their TLBs
+#define TLB_SHOOTDOWN_IDT 0xE1
+
+// start the other CPUs, returns once they're running (or have timed out)
+// only with -DENABLE_SMP, otherwise everything runs on the BSP
+void init_smp();
+
+// make every other online CPU drop its whole TLB, returns once they all have
+void flush_remote_tlbs();
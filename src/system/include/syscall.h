@@ -4,6 +4,9 @@
 #include <system.h>
 
 
+// each CPU's `sysenter` entry stack
+#define SYSCALL_STACK_PAGES 4
+
 typedef uint (*SyscallPtr) (uint data);
 
 extern SyscallPtr syscall_table[SyscallCode::MAX];
@@ -12,3 +15,6 @@ extern SyscallPtr syscall_table[SyscallCode::MAX];
 void enter_kernel();
 void init_syscall();
 
+// point the calling CPU's sysenter MSRs at `enter_kernel()` and its `syscall_entry_stack`
+void init_syscall_cpu();
+
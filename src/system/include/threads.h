@@ -87,6 +87,14 @@ struct ThreadState {
 	
 };
 
+struct Process;
+struct WaitQueue;
+struct Lock;
+struct RWLock;
+
+// read holds a thread can have at once, counting each `rwlock_read()` of the same rwlock
+#define MAX_READ_HOLDS 8
+
 struct Thread {
 	// cpuState points at the last place we stored the CPU state.
 	// User thread states stay in the same place, but kernel threads store CPU state wherever the ESP was in the kernel thread
@@ -95,9 +103,51 @@ struct Thread {
 	void *stack;
 	uint stack_bytes;
 
-	// lock, signal
-	Thread *lock_next;
-	int *signal_wait;
+	// wait queue links, see locks.h. `wait_queue` is the queue we're on, nullptr if none
+	Thread *wait_next;
+	Thread *wait_prev;
+	WaitQueue *wait_queue;
+
+	// the lock we're waiting for, and the ones we hold (linked through `Lock::held_next`)
+	Lock *blocked_on;
+	Lock *held_locks;
+
+	// rwlocks we hold for reading, so `rwlock_release()` can tell a reader from a stray release
+	RWLock *read_held[MAX_READ_HOLDS];
+	uint num_read_held;
+
+	// futex wait, see futex.cpp. `futex_addr` is nullptr unless we're on a futex wait list
+	Thread *futex_next;
+	volatile uint *futex_addr;
+
+	// owner, and our slot in its `threads`
+	Process *proc;
+	uint index;
+
+	// passed to `exit_thread()`, for whoever joins us
+	int exit_code;
+
+	// scheduling, see scheduler.h
+	// `cpu` is the run queue the thread belongs to, `on_cpu` is set while some CPU is running it
+	uint cpu;
+	bool on_cpu;
+
+	// run queue links
+	// `priority` is where the thread is queued now, boosts wear off back to `base_priority`
+	// `inherited_priority` comes from threads waiting on our locks, NUM_PRIORITIES when there's none
+	uint base_priority;
+	uint inherited_priority;
+	uint priority;
+	bool queued;
+	Thread *run_next;
+	Thread *run_prev;
+
+	// timeout, see `set_timeout()`
+	// `timer_slot` is our index in `timer_heaps[timer_cpu]`, or -1 while no timeout is pending
+	unsigned long long deadline;
+	int timer_slot;
+	uint timer_cpu;
+	bool timed_out;
 
 	void init(void *function, void *stack, uint stack_bytes){}
 	void initCPUState();
@@ -108,20 +158,34 @@ struct Thread {
 	void dump();
 };
 
-extern Thread *thisThread;
+// INTERRUPT_DEFINITION saves the CPU state through `thisThread` without knowing its type
+static_assert(__builtin_offsetof(Thread, cpuState) == 0, "cpuState must be the first member of Thread");
 
 struct KernelThread: public Thread {
 	void init(void *function, void *stack, uint stack_bytes);
 };
 
+// stacks `new_user_thread()` allocates, exited threads' stacks are cached for reuse (see `Process::stack_cache`)
+#define USER_STACK_BYTES         (16 * 4096)
+#define USER_SYSCALL_STACK_PAGES 16
+
 struct UserThread: public Thread {
 	void *syscall_stack;
 	uint syscall_stack_bytes;
 	uint syscall_esp; // simply points at the end of syscall_stack
+	// false if whoever created the thread passed in its stack, it's theirs to free
+	bool owns_stack;
 	void init(void *function, void *stack, uint stack_bytes);
 };
 
 
 UserThread *new_user_thread(void *function, int data, uint stack_bytes=0, void *stack=nullptr);
 
+// end the current user thread: DONE, its kernel locks released and its joiners woken. Never returns
+void exit_thread(int exit_code);
+
+// wait for thread `index` of the current process to exit, then free its slot and stacks
+// false if there's no such thread, it's the caller, or another thread joined it first
+bool join_thread(uint index, int *exit_code);
+
 void yield();
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <std/types.h>
+#include <std/atomic.h>
+
+/*
+ Bookkeeping for which parts of a virtual address range are in use.
+
+ Areas are kept in a treap ordered by start address. Every node also summarizes its subtree (lowest start, highest end and the largest gap between areas inside it), so first-fit allocation only walks one path down the tree.
+*/
+
+struct VMArea {
+	uint start;  // first byte
+	uint end;    // one past the last byte
+	uint attributes;
+	// thread stacks and the like, which user code mustn't free from under the kernel
+	bool kernel_owned;
+	// set by `claim()`: the area is being unmapped, and stays in the tree until `release()` so nobody else is handed it meanwhile
+	bool releasing;
+
+	VMArea *left;
+	VMArea *right;
+	uint priority;
+
+	// subtree summary:
+	uint lo;
+	uint hi;
+	uint max_gap;
+
+	uint pages() {
+		return (end - start) / 4096;
+	}
+};
+
+struct VMSpace {
+	uint base;
+	uint limit;
+	VMArea *root;
+	SpinLock mutex;
+
+	void init(uint base, uint limit);
+
+	// reserve `pages` anywhere in the range, returns the start address or nullptr
+	void *alloc(uint pages, uint attributes);
+
+	// reserve `pages` at `vaddr`, fails if any of it is already in use
+	bool reserve(void *vaddr, uint pages, uint attributes);
+
+	// find the area containing `vaddr`, or nullptr
+	VMArea *find(void *vaddr);
+
+	// start freeing the area starting at `vaddr`: returns its size in pages, 0 if there isn't one or someone else already claimed it
+	// areas marked with `mark_kernel_owned()` can only be claimed for the kernel
+	// unmap the pages, then `release()` the area
+	uint claim(void *vaddr, bool kernel=true);
+
+	// remove the area starting at `vaddr` and return its size in pages, 0 if there isn't one
+	uint release(void *vaddr);
+
+	// refuse user frees of the area starting at `vaddr`, for as long as it exists
+	// returns false if there's no area starting at `vaddr`
+	bool mark_kernel_owned(void *vaddr);
+
+	bool contains(void *vaddr) {
+		return ((uint) vaddr >= base) && ((uint) vaddr < limit);
+	}
+
+private:
+	uint find_gap(uint bytes);
+	VMArea *find_start(uint start);
+};
+
+// kernel window areas, shared by every address space
+extern VMSpace kernel_vm;
+
+void init_vmspace();
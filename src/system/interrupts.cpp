@@ -2,8 +2,6 @@
 #include <util/debug.h>
 #include <interrupts.h>
 
-void *interrupt_stack;
-
 IDT *idt;
 
 INTERRUPT_DEFINITION(unhandled_exception)
@@ -104,14 +102,18 @@ INTERRUPT_DEFINITION(gpf_interrupt)
 
 
 
-void init_interrupts() {
-	// virtual 0x500 points to physical 0x500, a free chunk of memory for the IDT
-	idt = new ((void *) 0x500) IDT();
-
+void load_idt() {
 	IDTR idtr;
 	idtr.base_address = idt;
 	idtr.limit = sizeof(idt->table) - 1;
 
+	__asm__ volatile("lidt %0"::"m" (idtr));
+}
+
+void init_interrupts() {
+	// virtual 0x500 points to physical 0x500, a free chunk of memory for the IDT
+	idt = new ((void *) 0x500) IDT();
+
 	uint num_interrupts = (sizeof(idt->table) / sizeof(InterruptDescriptor));
 
 	for (int i = 0; i < num_interrupts; i++) {
@@ -134,7 +136,7 @@ void init_interrupts() {
 	idt->table[0x0D].set_handler((void *) gpf_interrupt);
 
 
-	__asm__ volatile("lidt %0"::"p" (idtr));
+	load_idt();
 	sti();
 
 }
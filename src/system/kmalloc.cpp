@@ -0,0 +1,68 @@
+#include <new>
+#include <std/types.h>
+#include <std/bitops.h>
+#include <memory.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <util/debug.h>
+
+#pragma push_macro("DEBUG_LEVEL")
+
+#define DEBUG_LEVEL 0
+
+static SlabCache *size_classes[KMALLOC_CLASSES];
+
+static const char *class_names[KMALLOC_CLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+void *kmalloc(uint size) {
+	if (size == 0) return nullptr;
+
+	if (size <= (1 << KMALLOC_MAX_SHIFT)) {
+		// smallest class that fits
+		uint shift = (size <= (1 << KMALLOC_MIN_SHIFT)) ? KMALLOC_MIN_SHIFT : bitscan_reverse(size - 1) + 1;
+		return slab_alloc(size_classes[shift - KMALLOC_MIN_SHIFT]);
+	}
+
+	uint pages = (size + sizeof(PageFrame) - 1) / sizeof(PageFrame);
+	void *ptr = virt_alloc_pages(pages, PAGE_KERNEL_DATA);
+
+	debug(9, "kmalloc ", pages, " pages @ ", (hex) ptr);
+	return ptr;
+}
+
+void kfree(void *ptr) {
+	if (ptr == nullptr) return;
+
+	if (((uint) ptr >= KERNEL_VIRT_BASE) && ((uint) ptr < KERNEL_VM_BASE)) {
+		slab_free(ptr);
+	} else {
+		virt_release(ptr);
+	}
+}
+
+void init_kmalloc() {
+	for (uint c = 0; c < KMALLOC_CLASSES; c++) {
+		size_classes[c] = slab_cache_create(class_names[c], 1 << (c + KMALLOC_MIN_SHIFT));
+	}
+}
+
+void *operator new(size_t size) {
+	return kmalloc(size);
+}
+
+void *operator new[](size_t size) {
+	return kmalloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+	kfree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	kfree(ptr);
+}
+
+#pragma pop_macro("DEBUG_LEVEL")
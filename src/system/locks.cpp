@@ -1,20 +1,523 @@
 #include <util/debug.h>
 #include <std/types.h>
+#include <std/atomic.h>
+#include <devices/cpu.h>
 #include <locks.h>
 #include <threads.h>
 #include <process.h>
+#include <scheduler.h>
 
 #pragma push_macro("DEBUG_LEVEL")
 
 #define DEBUG_LEVEL 0
 
+// how far `propagate_priority()` follows a chain of threads blocked on each other's locks
+#define MAX_INHERIT_DEPTH 8
+
+// guards every wait queue, and the `owner`, `held_locks` and `blocked_on` links between threads and locks
+static SpinLock sync_lock;
+
+
+void WaitQueue::init() {
+	head = nullptr;
+	tail = nullptr;
+}
+
+void WaitQueue::push(Thread *thread) {
+	thread->wait_next = nullptr;
+	thread->wait_prev = tail;
+	thread->wait_queue = this;
+
+	if (tail != nullptr) {
+		tail->wait_next = thread;
+	} else {
+		head = thread;
+	}
+	tail = thread;
+}
+
+void WaitQueue::remove(Thread *thread) {
+	if (thread->wait_queue != this) return;
+
+	if (thread->wait_prev != nullptr) {
+		thread->wait_prev->wait_next = thread->wait_next;
+	} else {
+		head = thread->wait_next;
+	}
+	if (thread->wait_next != nullptr) {
+		thread->wait_next->wait_prev = thread->wait_prev;
+	} else {
+		tail = thread->wait_prev;
+	}
+
+	thread->wait_next = nullptr;
+	thread->wait_prev = nullptr;
+	thread->wait_queue = nullptr;
+}
+
+Thread *WaitQueue::pop() {
+	Thread *thread = head;
+	if (thread != nullptr) remove(thread);
+	return thread;
+}
+
+void Lock::init() {
+	owner = nullptr;
+	waiters.init();
+	held_next = nullptr;
+}
+
+void CondVar::init() {
+	waiters.init();
+}
+
+void Semaphore::init(int count) {
+	this->count = count;
+	waiters.init();
+}
+
+void RWLock::init() {
+	readers = 0;
+	writer = nullptr;
+	read_waiters.init();
+	write_waiters.init();
+}
+
+void Monitor::init() {
+	lock.init();
+	signalled.init();
+	signal = 0;
+	pollers = nullptr;
+}
+
+
+static bool block_on(WaitQueue *queue, unsigned long long deadline, uint flags) {
+// queue the current thread and sleep until it's woken or `deadline` passes
+// called with `sync_lock` held and interrupts saved in `flags`, returns with both the same. False if it timed out
+
+	Thread *thread = thisThread;
+	queue->push(thread);
+
+	if (deadline != 0) set_timeout(thread, deadline);
+	block_thread(thread);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	yield();
+
+	if (deadline != 0) cancel_timeout(thread);
+
+	irq_save();
+	sync_lock.lock();
+
+	// whoever woke us took us off the queue, so still being on it means the timeout fired first
+	bool woken = (thread->wait_queue != queue);
+	if (!woken) queue->remove(thread);
+	return woken;
+}
+
+static uint wake_waiters(WaitQueue *queue, uint count, bool boost) {
+	uint woken = 0;
+	for (Thread *thread; (woken < count) && ((thread = queue->pop()) != nullptr); woken++) {
+		wake_thread(thread, boost);
+	}
+	return woken;
+}
+
+static uint waiters_priority(Thread *owner) {
+	// the most urgent thread waiting on any lock `owner` holds, NUM_PRIORITIES if there's none
+	uint priority = NUM_PRIORITIES;
+	for (Lock *lock = owner->held_locks; lock != nullptr; lock = lock->held_next) {
+		for (Thread *waiter = lock->waiters.head; waiter != nullptr; waiter = waiter->wait_next) {
+			if (waiter->priority < priority) priority = waiter->priority;
+		}
+	}
+	return priority;
+}
+
+static void update_inherited(Thread *owner) {
+	// only owners that inherited something need to look at their waiters again, so an uncontended unlock stays O(1)
+	if (owner->inherited_priority == NUM_PRIORITIES) return;
+	inherit_priority(owner, waiters_priority(owner));
+}
+
+static void propagate_priority(Thread *waiter) {
+	// the owner of the lock `waiter` blocks on runs at least as urgently, and so on down the chain
+	uint priority = waiter->priority;
+
+	for (int depth = 0; (waiter->blocked_on != nullptr) && (depth < MAX_INHERIT_DEPTH); depth++) {
+		Thread *owner = waiter->blocked_on->owner;
+		if ((owner == nullptr) || (owner->inherited_priority <= priority)) break;
+
+		inherit_priority(owner, priority);
+		waiter = owner;
+	}
+}
+
+static void take_lock(Lock *lock, Thread *thread) {
+	lock->owner = thread;
+	lock->held_next = thread->held_locks;
+	thread->held_locks = lock;
+}
+
+static void release_locked(Lock *lock) {
+// hand `lock` to its first waiter, or leave it free. Called with `sync_lock` held
+
+	Thread *prev_owner = lock->owner;
+
+	Lock **link = &prev_owner->held_locks;
+	while ((*link != nullptr) && (*link != lock)) link = &(*link)->held_next;
+	if (*link != nullptr) *link = lock->held_next;
+	lock->held_next = nullptr;
+	lock->owner = nullptr;
+
+	Thread *next_owner = lock->waiters.pop();
+	if (next_owner != nullptr) {
+		next_owner->blocked_on = nullptr;
+		take_lock(lock, next_owner);
+
+		// it takes over holding up whoever's still waiting
+		if (!lock->waiters.empty()) inherit_priority(next_owner, waiters_priority(next_owner));
+
+		wake_thread(next_owner);
+	}
+
+	update_inherited(prev_owner);
+}
+
+bool lock_acquire(Lock *lock, unsigned long long deadline) {
+	Thread *thread = thisThread;
+
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	if (lock->owner == thread) {
+		sync_lock.unlock();
+		irq_restore(flags);
+		return true;
+	}
+
+	if (lock->owner == nullptr) {
+		take_lock(lock, thread);
+		sync_lock.unlock();
+		irq_restore(flags);
+		return true;
+	}
+
+	debug(9, "Lock owned by thread@", (hex) lock->owner);
+
+	thread->blocked_on = lock;
+	propagate_priority(thread);
+
+	block_on(&lock->waiters, deadline, flags);
+
+	// `release_locked()` may have handed us the lock just as the timeout fired
+	bool acquired = (lock->owner == thread);
+	if (!acquired) {
+		thread->blocked_on = nullptr;
+		// we no longer hold the owner up
+		if (lock->owner != nullptr) update_inherited(lock->owner);
+	}
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	return acquired;
+}
+
+void lock_release(Lock *lock) {
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	if (lock->owner == thisThread) release_locked(lock);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	// hand over straight away if the new owner is more urgent than we are
+	if (flags & 0x200) preempt_check();
+}
+
+bool cond_wait(CondVar *cond, Lock *lock, unsigned long long deadline) {
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	// giving up the lock and queueing happen together, so a `cond_signal()` from the next owner can't be missed
+	if (lock->owner == thisThread) release_locked(lock);
+	bool woken = block_on(&cond->waiters, deadline, flags);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	lock_acquire(lock);
+	return woken;
+}
+
+void cond_signal(CondVar *cond, uint count, bool boost) {
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	wake_waiters(&cond->waiters, count, boost);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	if (flags & 0x200) preempt_check();
+}
+
+void cond_broadcast(CondVar *cond) {
+	cond_signal(cond, (uint) -1);
+}
+
+bool sem_wait(Semaphore *sem, unsigned long long deadline) {
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	bool acquired = true;
+	if (sem->count > 0) {
+		sem->count--;
+	} else {
+		// `sem_post()` gives a unit to each thread it wakes instead of adding it to `count`
+		acquired = block_on(&sem->waiters, deadline, flags);
+	}
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	return acquired;
+}
+
+void sem_post(Semaphore *sem, int count) {
+	if (count <= 0) return;
+
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	sem->count += count - (int) wake_waiters(&sem->waiters, count, false);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	if (flags & 0x200) preempt_check();
+}
+
+static void admit_rwlock_waiters(RWLock *rwlock) {
+// once `rwlock` is free, hand it to the first waiting writer or else to every waiting reader. Called with `sync_lock` held
+
+	if ((rwlock->readers != 0) || (rwlock->writer != nullptr)) return;
+
+	Thread *writer = rwlock->write_waiters.pop();
+	if (writer != nullptr) {
+		rwlock->writer = writer;
+		wake_thread(writer);
+	} else {
+		rwlock->readers += wake_waiters(&rwlock->read_waiters, (uint) -1, false);
+	}
+}
+
+static bool drop_read_hold(Thread *thread, RWLock *rwlock) {
+	// forget one of `thread`'s read holds on `rwlock`, false if it has none
+	for (uint i = 0; i < thread->num_read_held; i++) {
+		if (thread->read_held[i] == rwlock) {
+			thread->read_held[i] = thread->read_held[--thread->num_read_held];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool rwlock_read(RWLock *rwlock, unsigned long long deadline) {
+	Thread *thread = thisThread;
+	// only this thread changes its own holds
+	if (thread->num_read_held == MAX_READ_HOLDS) return false;
+
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	bool acquired = true;
+	if ((rwlock->writer == nullptr) && rwlock->write_waiters.empty()) {
+		rwlock->readers++;
+	} else {
+		// `admit_rwlock_waiters()` counts us in before waking us
+		acquired = block_on(&rwlock->read_waiters, deadline, flags);
+	}
+	if (acquired) thread->read_held[thread->num_read_held++] = rwlock;
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	return acquired;
+}
+
+bool rwlock_write(RWLock *rwlock, unsigned long long deadline) {
+	Thread *thread = thisThread;
+
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	if ((rwlock->writer == nullptr) && (rwlock->readers == 0)) {
+		rwlock->writer = thread;
+	} else {
+		block_on(&rwlock->write_waiters, deadline, flags);
+
+		if (rwlock->writer != thread) {
+			if ((rwlock->writer == nullptr) && rwlock->write_waiters.empty()) {
+				// we timed out as the last writer waiting: the readers we held back join whoever is still reading
+				rwlock->readers += wake_waiters(&rwlock->read_waiters, (uint) -1, false);
+			} else {
+				admit_rwlock_waiters(rwlock);
+			}
+		}
+	}
+	bool acquired = (rwlock->writer == thread);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	return acquired;
+}
+
+void rwlock_release(RWLock *rwlock) {
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	// a release from a thread that holds neither side mustn't drop somebody else's read hold
+	if (rwlock->writer == thisThread) {
+		rwlock->writer = nullptr;
+	} else if (drop_read_hold(thisThread, rwlock)) {
+		rwlock->readers--;
+	}
+	admit_rwlock_waiters(rwlock);
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	if (flags & 0x200) preempt_check();
+}
+
+bool monitor_enter(Monitor *mon, int diff, unsigned long long deadline) {
+	if (!lock_acquire(&mon->lock, deadline)) return false;
+
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	while (mon->signal <= 0) {
+		// like `cond_wait()`, but checking `signal` and queueing can't be split by a `monitor_notify()`
+		release_locked(&mon->lock);
+		bool woken = block_on(&mon->signalled.waiters, deadline, flags);
+
+		sync_lock.unlock();
+		irq_restore(flags);
+
+		if (!lock_acquire(&mon->lock, deadline)) return false;
+
+		if (!woken && (mon->signal <= 0)) {
+			// timed out before a notify
+			lock_release(&mon->lock);
+			return false;
+		}
+
+		irq_save();
+		sync_lock.lock();
+	}
+
+	mon->signal -= diff;
+
+	// clamp to 0
+	if (mon->signal < 0) mon->signal = 0;
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	// keep ownership of lock
+	return true;
+}
+
+void monitor_notify(Monitor *mon, int diff) {
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	mon->signal += diff;
+
+	if ((mon->signal > 0) && (diff > 0)) {
+		// they were waiting on input, let them respond before the threads that kept running
+		wake_waiters(&mon->signalled.waiters, diff, true);
+
+		// a poller's queue only ever holds its own thread, so it's woken once however many of its monitors fire
+		for (MonitorPoll *poll = mon->pollers; poll != nullptr; poll = poll->next) {
+			wake_waiters(poll->queue, 1, true);
+		}
+	}
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	// from an interrupt handler, `interrupt_exit()` does the switch instead
+	if (flags & 0x200) preempt_check();
+}
+
+static uint ready_monitors(Monitor **mons, uint count) {
+	uint ready = 0;
+	for (uint m = 0; m < count; m++) {
+		if (mons[m]->signal > 0) ready |= 1 << m;
+	}
+	return ready;
+}
+
+uint monitor_wait_any(Monitor **mons, uint count, unsigned long long deadline) {
+	if (count > MAX_WAIT_ANY) count = MAX_WAIT_ANY;
+
+	WaitQueue queue;
+	queue.init();
+	MonitorPoll polls[MAX_WAIT_ANY];
+
+	uint flags = irq_save();
+	sync_lock.lock();
+
+	uint ready = ready_monitors(mons, count);
+	while (ready == 0) {
+		for (uint m = 0; m < count; m++) {
+			polls[m].queue = &queue;
+			polls[m].prev = nullptr;
+			polls[m].next = mons[m]->pollers;
+			if (mons[m]->pollers != nullptr) mons[m]->pollers->prev = &polls[m];
+			mons[m]->pollers = &polls[m];
+		}
+
+		bool woken = block_on(&queue, deadline, flags);
+
+		for (uint m = 0; m < count; m++) {
+			if (polls[m].prev != nullptr) {
+				polls[m].prev->next = polls[m].next;
+			} else {
+				mons[m]->pollers = polls[m].next;
+			}
+			if (polls[m].next != nullptr) polls[m].next->prev = polls[m].prev;
+		}
+
+		// another thread may have taken the signal before we got to look
+		ready = ready_monitors(mons, count);
+		if (!woken) break;
+	}
+
+	sync_lock.unlock();
+	irq_restore(flags);
+
+	return ready;
+}
+
+void init_locks() {
+	sync_lock.locked = 0;
+}
+
 
 void unmonitor(int monitor_h) {
 	thisProc->unmonitor(monitor_h);
 }
 
-void monitor(int monitor_h, int diff) {
-	thisProc->monitor(monitor_h, diff);
+bool monitor(int monitor_h, int diff, uint timeout_ms) {
+	return thisProc->monitor(monitor_h, diff, timeout_ms);
 }
 
 void notify(int monitor_h, int diff) {
@@ -15,11 +15,14 @@
 
 #include <page.h>
 #include <memory.h>
+#include <kmalloc.h>
 #include <interrupts.h>
 #include <process.h>
 #include <events.h>
 #include <syscall.h>
+#include <futex.h>
 #include <scheduler.h>
+#include <smp.h>
 
 #include <gui.h>
 #include <gui/objects.h>
@@ -67,42 +70,46 @@ extern "C" void _start(uint arg1) {
 
 	// Initialize page tables and allocation table:
 	debug(0, "Initializing memory:");
-	initialize_memory((void *) 0x100000);
+	initialize_memory((void *) 0x100000, memMap, memMapSize);
 	// NOTE do not print() or debug() until video memory is mapped
 
 
 	// map video memory
 	{
 		PageFrame *vid_memory = (PageFrame *)0xE0000000;
-		// ensure the page table is marked as PAGE_GLOBAL_DATA:
-		ensure_pte(vid_memory, PAGE_GLOBAL_DATA);
 
-		for (int i = 0; i < 1024; i++) {
-			map_to(&vid_memory[i], &vid_memory[i], PAGE_GLOBAL_DATA);
+		// one 4MB page covers the whole framebuffer, and costs a single TLB entry to blit
+		if (map_large(vid_memory, vid_memory, PAGE_GLOBAL_DATA) == nullptr) {
+			// ensure the page table is marked as PAGE_GLOBAL_DATA:
+			ensure_pte(vid_memory, PAGE_GLOBAL_DATA);
+
+			for (int i = 0; i < 1024; i++) {
+				map_to(&vid_memory[i], &vid_memory[i], PAGE_GLOBAL_DATA);
+			}
 		}
 	}
 
 	// LAPIC memory-mapped IO address:
+	// kernel-only and shared by every process, like the rest of the devices
 	ensure_pte((void *) LAPIC_ADDRESS, PAGE_GLOBAL_DATA);
-	map_to((void *) LAPIC_ADDRESS, (void *) LAPIC_ADDRESS);
+	map_to((void *) LAPIC_ADDRESS, (void *) LAPIC_ADDRESS, PAGE_GLOBAL_DATA | PAGE_CACHEDISABLED);
 
 	// IOAPIC memory-mapped IO address:
 	ensure_pte((void *) IOAPIC_ADDRESS, PAGE_GLOBAL_DATA);
-	map_to((void *) IOAPIC_ADDRESS, (void *) IOAPIC_ADDRESS);
+	map_to((void *) IOAPIC_ADDRESS, (void *) IOAPIC_ADDRESS, PAGE_GLOBAL_DATA | PAGE_CACHEDISABLED);
+
+#ifdef BENCHMARK_TLB
+	benchmark_tlb();
+#endif
 
 
 	// Allocate some space for interrupt handlers
-	interrupt_stack = (void *) ((int) static_alloc_pages(1) + 4096);
+	// (the task register was loaded along with the BSP's GDT in `init_percpu()`)
+	this_cpu()->interrupt_stack = (void *) ((int) static_alloc_pages(1) + 4096);
 
 	sti();
 
-	debug(9, "Interrupt stack@", (hex) interrupt_stack);
-
-	// Initialize Task register (TSS is setup in `boot_stub.nasm`)
-	__asm__ volatile(
-		"movw $0x28, %%dx\n"
-		"ltr %%dx\n"
-		:::"edx");
+	debug(9, "Interrupt stack@", (hex) this_cpu()->interrupt_stack);
 
 	debug(0, "Initializing IDE driver...");
 
@@ -116,6 +123,9 @@ extern "C" void _start(uint arg1) {
 	// Init process table
 	init_processes();
 
+	// wait queues for user-space locks
+	init_futex();
+
 	debug(0, "Initializing GUI...");
 	// Init GUI here so we can create a GUI terminal
 	init_gui(VGA_WIDTH, VGA_HEIGHT);
@@ -139,23 +149,29 @@ extern "C" void _start(uint arg1) {
 	// init LAPIC & timer
 	init_lapic();
 
-	// Set the timer handler:
+	// Set the timer handler and start this CPU's tick:
 	init_scheduler();
 
-	// fast tick
-	lapic->timer_div = (uint) 0x08;
-	lapic->timer_init = (uint) 0x0FFFF;
-
 	init_ioapic();
 
 	init_ps2(VGA_WIDTH, VGA_HEIGHT);
 
+	// bring up the other CPUs, they join in scheduling as soon as they're running
+	init_smp();
+
 	debug(9, "Done initializing kernel. Static mem left: ", (hex) (static_alloc_limit - static_alloc_ptr));
 
 	new_display_msg({.event=DisplayEvents::REDRAW_SCREEN});
 
-	thisThread->runState = WAITING;
-	SPINHLT();
+	cli();
+	block_thread(thisThread);
+	sti();
+
+	// this is now the idle thread: prepare zeroed frames whenever there's nothing else to do
+	for (;;) {
+		refill_zero_pool();
+		__asm__ volatile("hlt");
+	}
 
 }
 
@@ -199,9 +215,8 @@ GUIModel::GUIModel () {
 
 
 	int desktop_img_len = VGA_WIDTH * VGA_HEIGHT * 2;
-	int desktop_img_pages = (desktop_img_len + 4095) / 4096;
 
-	ushort *desktop_img_data = (ushort *) static_alloc_pages(desktop_img_pages);
+	ushort *desktop_img_data = (ushort *) kmalloc(desktop_img_len);
 
 	// checker pattern for testing:
 	for (int y = 0; y < VGA_HEIGHT; y++) {
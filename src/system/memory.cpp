@@ -6,6 +6,13 @@
 #include <process.h>
 #include <devices/cpu.h>
 #include <memory.h>
+#include <buddy.h>
+#include <percpu.h>
+#include <smp.h>
+#include <slab.h>
+#include <vmspace.h>
+#include <fastmem.h>
+#include <kmalloc.h>
 #include <page.h>
 #include <util/debug.h>
 
@@ -13,9 +20,8 @@
 
 #define DEBUG_LEVEL 0
 
-// how many bits, bytes, and dwords required to map all pages:
+// most bits we'd need to map all pages (4GB), used when the BIOS gives us no memory map:
 #define PAGE_BITMAP_BITS    (1<<20)
-#define PAGE_BITMAP_BYTES   PAGE_BITMAP_BITS / 8
 
 // how many attempts to race for static data ptr:
 #define MAX_ALLOC_TRIES 10
@@ -25,66 +31,129 @@
 uint static_alloc_ptr;
 uint static_alloc_limit;
 
-// this is used for expanding virtual memory:
-uint virt_alloc_ptr;
-
 PageTable *page_tables;
 PageTable *page_dir;
 
 // each bit in this bitset represents a 4k page in physical memory. 0=free 1=used.
 BitAllocator<> *page_allocator;
 
-// allocate a number of virtual pages starting at a given virtual address
-void *virt_alloc_pages(uint pages, void *address, uint attributes) {
-	PageFrame *virt_addr_ptr = (PageFrame *) address;
+// mapping count of each physical frame, see memory.h
+volatile uchar *page_refs;
 
-	uint pages_left = pages;
+// CPU supports 4MB pages (CR4.PSE is set)
+static bool has_pse;
 
-	// start our search at a "random" low index
-	uint block_index = prand() % 256;
+static PageFrame *virt_alloc_scattered(uint pages, PageFrame *virt_addr_ptr, uint attributes) {
+	// map `pages` free physical pages one at a time, wherever they are
+	// returns the next unmapped virtual page, or nullptr on failure
 
-	// lock next available block
-	uint locked_bits;
-	debug(8, "page_allocator bits @ ", (hex) &page_allocator->bitset_blocks);
-	while ((block_index = page_allocator->lock_next_block(&locked_bits, block_index))) {
+	for (uint i = 0; i < pages; i++) {
+		// user pages mustn't show what the frame held before
+		void *phys_addr_ptr = (attributes & PAGE_USER) ? phys_alloc_zeroed_page() : phys_alloc_page();
+		if (phys_addr_ptr == nullptr) return nullptr;
+
+		if (map_to(virt_addr_ptr, phys_addr_ptr, attributes) == nullptr) {
+			// no frame left for the page table
+			phys_free_page(phys_addr_ptr);
+			return nullptr;
+		}
+		virt_addr_ptr++;
+	}
 
-		PageFrame *phys_addr_ptr = (PageFrame *) (block_index * 32 * 4096);
+	return virt_addr_ptr;
+}
 
-		uint testbit = 1;
-		while (locked_bits != -1) {
+static void *virt_reserve_pages(uint pages, PageFrame *virt_addr_ptr, uint attributes) {
+	// leave the pages unmapped but marked PAGE_DEMAND, with the attributes they'll get on first touch
+	uint pde_attributes = (attributes & ~PAGE_DEMAND) | PAGE_PRESENT;
+	uint pte_val = (attributes | PAGE_DEMAND) & ~PAGE_PRESENT & 0xFFF;
 
-			if (!(locked_bits & testbit)) {
-			// a page is free
+	for (uint i = 0; i < pages; i++) {
+		PageMapEntry *pte = ensure_pte(&virt_addr_ptr[i], pde_attributes);
+		if (pte == nullptr) return nullptr;
+		pte->val = pte_val;
+	}
+	return virt_addr_ptr;
+}
 
-				map_to(virt_addr_ptr, (void *) phys_addr_ptr, attributes);
-				locked_bits |= testbit;
-				virt_addr_ptr++;
-				pages_left--;
+// allocate a number of virtual pages starting at a given virtual address
+void *virt_alloc_pages(uint pages, void *address, uint attributes) {
+	PageFrame *virt_addr_ptr = (PageFrame *) address;
 
-				if (pages_left <= 0) {
-	
-					page_allocator->unlock_block(locked_bits, block_index);
-					debug(9, "Locked page at vaddr=", (hex) address);
-					return address;
-				}
+	if (attributes & PAGE_DEMAND) return virt_reserve_pages(pages, virt_addr_ptr, attributes);
+
+	uint pages_left = pages;
+
+	// map as much as we can with physically contiguous runs from the buddy allocator
+	while (pages_left > 1) {
+		uint order = bitscan_reverse(pages_left);
+		if (order > BUDDY_MAX_ORDER) order = BUDDY_MAX_ORDER;
+
+		int frame = -1;
+		for (; order > 0; order--) {
+			frame = buddy_allocator->alloc(order);
+			if (frame >= 0) break;
+		}
+		if (frame < 0) break;
+
+		PageFrame *phys_addr_ptr = (PageFrame *) (frame * sizeof(PageFrame));
+		uint run = 1 << order;
+		for (uint i = 0; i < run; i++) {
+			page_refs[frame + i] = 1;
+			if (map_to(virt_addr_ptr, (void *) phys_addr_ptr, attributes) == nullptr) {
+				// the rest of the run never got mapped, so the caller's cleanup won't find it
+				phys_free_pages(phys_addr_ptr, run - i);
+				return nullptr;
 			}
 			phys_addr_ptr++;
-			testbit <<= 1;
-
+			if (attributes & PAGE_USER) page_zero(virt_addr_ptr);
+			virt_addr_ptr++;
 		}
+		pages_left -= run;
 	}
 
-	return nullptr;
+	// the rest comes from anywhere in the page bitmap
+	if (pages_left > 0) {
+		if (virt_alloc_scattered(pages_left, virt_addr_ptr, attributes) == nullptr) return nullptr;
+	}
+
+	debug(9, "Locked pages at vaddr=", (hex) address);
+	return address;
 }
 void *virt_alloc_pages(uint pages, void *address) {
 	// sane defaults
 	return virt_alloc_pages(pages, address, PAGE_USER_DATA);
 }
 
+static VMSpace *vmspace_of(void *vaddr) {
+	// the area tree that `vaddr` is allocated from
+	if (kernel_vm.contains(vaddr)) return &kernel_vm;
+	if ((thisProc != nullptr) && thisProc->vm.contains(vaddr)) return &thisProc->vm;
+	return nullptr;
+}
+
 //allocate a number of virtual pages, doesn't matter where
 void *virt_alloc_pages(uint pages, uint attributes) {
-	PageFrame *vaddr = (PageFrame *) next_virtual_pages(pages);
-	return virt_alloc_pages(pages, vaddr, attributes);
+	VMSpace *vm;
+
+	if (attributes & PAGE_USER) {
+		vm = &thisProc->vm;
+	} else {
+		// kernel data goes in the window that every address space shares
+		vm = &kernel_vm;
+		attributes |= PAGE_GLOBAL;
+	}
+
+	PageFrame *vaddr = (PageFrame *) vm->alloc(pages, attributes);
+	if (vaddr == nullptr) return nullptr;
+
+	if (virt_alloc_pages(pages, vaddr, attributes) == nullptr) {
+		// give back whatever did get mapped
+		virt_free_pages(vaddr, pages);
+		vm->release(vaddr);
+		return nullptr;
+	}
+	return vaddr;
 }
 
 void *virt_alloc_pages(uint pages) {
@@ -110,20 +179,163 @@ void *virt_alloc_page(void *address) {
 
 //get next available virtual pages, doesn't matter where
 void *next_virtual_pages(uint pages) {
-	uint newval = atomic_add_limit(
-		virt_alloc_ptr,
-		(uint) (pages * BYTES_PER_PAGE),
-		(uint) -1	
-	);
-	if (newval == (uint) -1) {
-		return nullptr;
-	}
-	return (void *) newval;
+	return thisProc->vm.alloc(pages, PAGE_USER_DATA);
 }
 void *next_virtual_page() {
 	return next_virtual_pages(1);
 }
 
+void *next_kernel_pages(uint pages) {
+	return kernel_vm.alloc(pages, PAGE_GLOBAL_DATA);
+}
+
+void TLBFlush::add(void *vaddr, PageMapEntry old) {
+	// the TLB only caches present entries
+	if (old.present == 0) return;
+
+	if (old.global) global = true;
+	if (count < TLB_FLUSH_MAX) pages[count] = vaddr;
+	count++;
+}
+
+void TLBFlush::flush() {
+	// the other CPUs get a full flush, they may have cached any of these pages
+	if ((count > 0) && (cpus_online & ~(1 << this_cpu()->id))) flush_remote_tlbs();
+
+	if (count > TLB_FLUSH_MAX) {
+		if (global) {
+			// toggling CR4.PGE drops every entry, global or not
+			uint cr4 = read_cr4();
+			write_cr4(cr4 & ~CR4_PGE);
+			write_cr4(cr4);
+		} else {
+			uint cr3;
+			__asm__ volatile("mov %%cr3, %0":"=r"(cr3));
+			setPageDirectory(cr3);
+		}
+	} else {
+		for (uint i = 0; i < count; i++) {
+			__asm__ volatile("invlpg %0"::"m" (*(char *) pages[i]):"memory");
+		}
+	}
+	count = 0;
+	global = false;
+}
+
+static MemStats *user_stats(void *vaddr) {
+	// the counters of the process that owns `vaddr`, nullptr if it's not a user address
+	if ((thisProc == nullptr) || ((uint) vaddr < USER_VIRT_BASE) || ((uint) vaddr >= USER_VIRT_LIMIT)) return nullptr;
+	return &thisProc->mem_stats;
+}
+
+void *unmap(void *vaddr, TLBFlush *tlb) {
+	PageMapEntry *pde = get_pde(vaddr);
+	if (pde->present == 0) return nullptr;
+
+	// 4MB pages are only ever unmapped whole, by whoever mapped them
+	if (pde->pagesize) return nullptr;
+
+	PageMapEntry *pte = get_pte(vaddr);
+	PageMapEntry old = *pte;
+	// also drops any PAGE_DEMAND reservation
+	pte->val = 0;
+
+	if (old.present == 0) return nullptr;
+
+	MemStats *stats = user_stats(vaddr);
+	if (stats != nullptr) stats->resident_pages--;
+
+	tlb->add(vaddr, old);
+	return (void *) (old.val & 0xFFFFF000);
+}
+
+void *unmap(void *vaddr) {
+	TLBFlush tlb;
+	void *p_addr = unmap(vaddr, &tlb);
+	tlb.flush();
+	return p_addr;
+}
+
+void *remap(void *vaddr, void *p_addr, uint attributes, TLBFlush *tlb) {
+	PageMapEntry *pte = ensure_pte(vaddr, attributes);
+	if (pte == nullptr) return nullptr;
+	PageMapEntry old = *pte;
+
+	pte->val = (uint) p_addr | attributes;
+	tlb->add(vaddr, old);
+
+	MemStats *stats = user_stats(vaddr);
+	if (stats != nullptr) stats->resident_pages += (attributes & PAGE_PRESENT) - old.present;
+
+	return vaddr;
+}
+
+// frames `virt_free_pages()` holds on to until the TLBs have forgotten them
+#define FREE_BATCH 128
+
+void virt_free_pages(void *vaddr, uint pages) {
+	// frames are only unref'd after the flush: a sibling thread on another CPU can write through its stale TLB entry until then
+	TLBFlush tlb;
+	void *frames[FREE_BATCH];
+	uint num_frames = 0;
+
+	PageFrame *page = (PageFrame *) vaddr;
+	PageFrame *end = page + pages;
+	while (page < end) {
+		if (get_pde(page)->present == 0) {
+			// skip the rest of this empty 4MB
+			page = (PageFrame *) (((uint) page + 0x400000) & 0xFFC00000);
+			continue;
+		}
+		void *p_addr = unmap(page, &tlb);
+		if (p_addr != nullptr) frames[num_frames++] = p_addr;
+		page++;
+
+		if (num_frames == FREE_BATCH) {
+			tlb.flush();
+			for (uint i = 0; i < num_frames; i++) page_unref(frames[i]);
+			num_frames = 0;
+		}
+	}
+
+	tlb.flush();
+	for (uint i = 0; i < num_frames; i++) page_unref(frames[i]);
+}
+
+void virt_free_page(void *vaddr) {
+	virt_free_pages(vaddr, 1);
+}
+
+uint virt_release(void *vaddr) {
+	VMSpace *vm = vmspace_of(vaddr);
+	if (vm == nullptr) return 0;
+
+	// the area stays ours until its pages are gone, or a concurrent alloc could map new frames there for us to tear down
+	uint pages = vm->claim(vaddr);
+	if (pages == 0) return 0;
+	virt_free_pages(vaddr, pages);
+	vm->release(vaddr);
+
+	debug(9, "Released ", pages, " pages at vaddr=", (hex) vaddr);
+	return pages;
+}
+
+
+void *kmap(uint slot, void *p_addr) {
+	PageFrame *vaddr = &this_cpu()->kmap_slots[slot];
+
+	get_pte(vaddr)->val = (uint) p_addr | PAGE_KERNEL_DATA;
+	__asm__ volatile("invlpg %0"::"m" (*(char *) vaddr):"memory");
+
+	return vaddr;
+}
+
+void kunmap(uint slot) {
+	PageFrame *vaddr = &this_cpu()->kmap_slots[slot];
+
+	get_pte(vaddr)->val = 0;
+	__asm__ volatile("invlpg %0"::"m" (*(char *) vaddr):"memory");
+}
 
 uint get_pde_index(void *vaddr) {
 	return (uint) vaddr >> 22;
@@ -139,54 +351,325 @@ uint get_pte_index(void *vaddr) {
 	return (uint) vaddr >> 12;
 }
 PageMapEntry *get_pte(void *vaddr) {
+	// a 4MB page has no page table, its PDE is the entry that maps `vaddr`
+	PageMapEntry *pde = get_pde(vaddr);
+	if (pde->present && pde->pagesize) return pde;
+
 	// index into the 4MB page table array
 	uint ptbl_index = get_pte_index(vaddr);
 
 	return &((PageMapEntry *)page_tables)[ptbl_index];
 }
 
-uint lock_next_page(){
-	// locks the next available page in the bitset
-	// returns the locked bit index
-
-	// lock the next free bit after `start_block_index`
+void PageMagazine::refill() {
+	// reserve up to MAGAZINE_BATCH free frames from the page bitmap, a whole block at a time
 
-	// start our search at a pseudo-random low index
-	uint start_block_index = prand() % 256;
+	// lowest free blocks first, so single frames stay packed at the bottom and whole 4MB groups are left for buddy arenas
+	uint block_index = 0;
 
 	uint locked_bits;
-	uint locked_index = page_allocator->lock_next_block(&locked_bits, start_block_index);
-	// return 0 on failure
-	if (locked_bits == -1) return 0;
-
-	// find available bit in this block
-	uint bit_index = bitscan_forward(~locked_bits);
-	uint bitmask = 1 << bit_index;
-	// mark it as used
-	locked_bits |= bitmask;
-	page_allocator->unlock_block(locked_bits, locked_index);
-	// return the bit index that was locked
-	uint locked_bit_index = (locked_index * 32) + bit_index;
-	return locked_bit_index;
+	while (count < MAGAZINE_BATCH) {
+		uint start = block_index;
+		block_index = page_allocator->lock_next_block(&locked_bits, start);
+
+		// the search doesn't wrap, and blocks below where we got to may have been freed since
+		if ((locked_bits == -1) && (start != 0)) block_index = page_allocator->lock_next_block(&locked_bits, 0);
+		if (locked_bits == -1) return;
+
+		while ((locked_bits != -1) && (count < MAGAZINE_BATCH)) {
+			uint bit_index = bitscan_forward(~locked_bits);
+			locked_bits |= (1 << bit_index);
+			frames[count++] = (block_index * 32) + bit_index;
+		}
+		page_allocator->unlock_block(locked_bits, block_index);
+	}
+}
+
+void PageMagazine::drain() {
+	// give the oldest MAGAZINE_BATCH frames back to the page bitmap
+	for (uint i = 0; i < MAGAZINE_BATCH; i++) {
+		page_allocator->unlock_bit(frames[i]);
+	}
+	count -= MAGAZINE_BATCH;
+	for (uint i = 0; i < count; i++) {
+		frames[i] = frames[i + MAGAZINE_BATCH];
+	}
+}
+
+// set when the page bitmap ran dry, idle CPUs then hand their zeroed frames back instead of preparing more
+static volatile bool frames_low;
+
+static void *magazine_alloc_page() {
+	// a frame from this CPU's magazine or the page bitmap, nullptr if both are empty
+	void *page = nullptr;
+
+	uint flags = irq_save();
+	PageMagazine *mag = &this_cpu()->page_cache;
+
+	if (mag->count == 0) mag->refill();
+	if (mag->count > 0) {
+		uint frame = mag->frames[--mag->count];
+		page_refs[frame] = 1;
+		page = (void *) (frame * sizeof(PageFrame));
+	}
+	irq_restore(flags);
+
+	return page;
 }
+
 void *phys_alloc_page() {
 	// allocates the next available physical page
-	return (void *) (lock_next_page() * sizeof(PageFrame));
+	// returns nullptr on failure
+	void *page = magazine_alloc_page();
+	if (page != nullptr) return page;
+
+	// a zeroed frame is still a frame
+	uint flags = irq_save();
+	PageMagazine *pool = &this_cpu()->zero_pool;
+	if (pool->count > 0) {
+		uint frame = pool->frames[--pool->count];
+		page_refs[frame] = 1;
+		page = (void *) (frame * sizeof(PageFrame));
+	}
+	irq_restore(flags);
+
+	frames_low = true;
+	return page;
+}
+
+void *phys_alloc_zeroed_page() {
+	void *page = nullptr;
+
+	uint flags = irq_save();
+	PageMagazine *pool = &this_cpu()->zero_pool;
+
+	if (pool->count > 0) {
+		uint frame = pool->frames[--pool->count];
+		page_refs[frame] = 1;
+		page = (void *) (frame * sizeof(PageFrame));
+	} else {
+		// nothing prepared, zero one now
+		page = phys_alloc_page();
+		if (page != nullptr) {
+			page_zero(kmap(KMAP_ZERO, page));
+			kunmap(KMAP_ZERO);
+		}
+	}
+	irq_restore(flags);
+
+	return page;
+}
+
+static void drain_zero_pool() {
+	// give this CPU's zeroed frames back to the page bitmap, where every CPU can allocate them
+	uint flags = irq_save();
+	PageMagazine *pool = &this_cpu()->zero_pool;
+
+	while (pool->count > 0) {
+		uint frame = pool->frames[--pool->count];
+		page_refs[frame] = 0;
+		page_allocator->unlock_bit(frame);
+	}
+	irq_restore(flags);
+}
+
+void refill_zero_pool() {
+	if (frames_low) {
+		// go back to preparing frames once there's plenty free again
+		if (page_allocator->count_free() < MAGAZINE_SIZE * MAX_CPUS) {
+			drain_zero_pool();
+			return;
+		}
+		frames_low = false;
+	}
+
+	// one frame at a time with interrupts off, so the idle thread never holds up anything else for long
+	for (;;) {
+		uint flags = irq_save();
+		PageMagazine *pool = &this_cpu()->zero_pool;
+
+		if (pool->count == MAGAZINE_SIZE) {
+			irq_restore(flags);
+			return;
+		}
+
+		// not `phys_alloc_page()`, which would take the frame straight back out of this pool
+		void *page = magazine_alloc_page();
+		if (page == nullptr) {
+			irq_restore(flags);
+			return;
+		}
+
+		page_zero(kmap(KMAP_ZERO, page));
+		kunmap(KMAP_ZERO);
+
+		pool->frames[pool->count++] = (uint) page / sizeof(PageFrame);
+		irq_restore(flags);
+	}
+}
+
+static void phys_free_single_page(uint frame) {
+	uint flags = irq_save();
+	PageMagazine *mag = &this_cpu()->page_cache;
+
+	if (mag->count == MAGAZINE_SIZE) mag->drain();
+	mag->frames[mag->count++] = frame;
+	irq_restore(flags);
+}
+
+void *phys_alloc_pages(uint pages) {
+	// allocates `pages` physically contiguous pages
+	// returns the physical address, or nullptr on failure
+	if (pages == 0) return nullptr;
+	if (pages == 1) return phys_alloc_page();
+
+	uint order = bitscan_reverse(pages - 1) + 1;
+	if (order > BUDDY_MAX_ORDER) return nullptr;
+
+	int frame = buddy_allocator->alloc(order);
+	if (frame < 0) return nullptr;
+
+	// give back the tail of the block beyond `pages`, in the largest aligned pieces possible
+	uint block_pages = 1 << order;
+	for (uint p = pages; p < block_pages; ) {
+		uint k = bitscan_forward(p);
+		buddy_allocator->free(frame + p, k);
+		p += (1 << k);
+	}
+
+	for (uint p = 0; p < pages; p++) {
+		page_refs[frame + p] = 1;
+	}
+
+	return (void *) (frame * sizeof(PageFrame));
+}
+
+void phys_free_pages(void *p_addr, uint pages) {
+	uint frame = (uint) p_addr / sizeof(PageFrame);
+
+	for (uint p = 0; p < pages; p++) {
+		page_refs[frame + p] = 0;
+	}
+
+	if (!buddy_allocator->owns(frame)) {
+		for (uint i = 0; i < pages; i++) {
+			phys_free_single_page(frame + i);
+		}
+		return;
+	}
+
+	// free the run as the largest naturally aligned blocks that fit
+	while (pages > 0) {
+		uint k = bitscan_reverse(pages);
+		if (frame & ((1 << k) - 1)) k = bitscan_forward(frame);
+		if (k > BUDDY_MAX_ORDER) k = BUDDY_MAX_ORDER;
+
+		buddy_allocator->free(frame, k);
+		frame += (1 << k);
+		pages -= (1 << k);
+	}
+}
+
+void phys_free_page(void *p_addr) {
+	phys_free_pages(p_addr, 1);
+}
+
+void page_ref(void *p_addr) {
+	uint frame = (uint) p_addr / sizeof(PageFrame);
+	// device memory past the end of RAM
+	if (frame >= page_allocator->max_bits) return;
+
+	uchar count;
+	do {
+		count = page_refs[frame];
+		if ((count == 0) || (count == PAGE_REF_PINNED)) return;
+	} while (__sync_val_compare_and_swap(&page_refs[frame], count, count + 1) != count);
+}
+
+void page_unref(void *p_addr) {
+	uint frame = (uint) p_addr / sizeof(PageFrame);
+	if (frame >= page_allocator->max_bits) return;
+
+	uchar count = page_refs[frame];
+	if ((count == 0) || (count == PAGE_REF_PINNED)) return;
+
+	if (__sync_sub_and_fetch(&page_refs[frame], 1) == 0) {
+		phys_free_page(p_addr);
+	}
+}
+
+uint count_free_frames() {
+	// frames in the bitmap, the buddy allocator's arenas and every CPU's magazines
+	uint frames = page_allocator->count_free() + buddy_allocator->free_pages();
+	for (int c = 0; c < MAX_CPUS; c++) {
+		frames += cpus[c].page_cache.count + cpus[c].zero_pool.count;
+	}
+	return frames;
+}
+
+uint page_refcount(void *p_addr) {
+	uint frame = (uint) p_addr / sizeof(PageFrame);
+	if (frame >= page_allocator->max_bits) return 0;
+
+	return page_refs[frame];
+}
+
+static bool split_large_page(PageMapEntry *pde, void *vaddr) {
+	// replace a 4MB mapping with a page table that maps the same memory in 4K pages
+	// returns false, leaving the 4MB mapping alone, if there's no frame for the table
+	uint base = pde->val & 0xFFC00000;
+	uint attributes = pde->val & 0xFFF & ~PAGE_LARGE;
+
+	void *table_paddr = phys_alloc_page();
+	if (table_paddr == nullptr) return false;
+
+	uint flags = irq_save();
+
+	// fill the table before it goes live, so nothing in the 4MB is ever unmapped
+	PageMapEntry *table = (PageMapEntry *) kmap(KMAP_COPY, table_paddr);
+	for (uint i = 0; i < 1024; i++) {
+		table[i].val = (base + i * sizeof(PageFrame)) | attributes;
+	}
+	kunmap(KMAP_COPY);
+
+	pde->val = (uint) table_paddr | attributes;
+
+	// drop the 4MB TLB entry, and the page table window's stale view of the old PDE
+	char *large_page = (char *) ((uint) vaddr & 0xFFC00000);
+	char *window = (char *) &page_tables[get_pde_index(vaddr)];
+	__asm__ volatile("invlpg %0"::"m" (*large_page):"memory");
+	__asm__ volatile("invlpg %0"::"m" (*window):"memory");
+
+	irq_restore(flags);
+
+	debug(9, "Split 4MB page at vaddr=", (hex) (uint) large_page);
+	return true;
 }
 
 PageMapEntry *ensure_pte(void *vaddr, uint attributes) {
 	/*
 		 Gets a page map entry, creating one if necessary
+		 4MB pages get split into 4K pages so the caller can change just one of them
+		 Returns nullptr if a page table was needed and there's no frame for it
 	*/
 
 	PageMapEntry *pde = get_pde(vaddr);
 
 	// if the page table hasn't been allocated, allocate one:
 	if (pde->present == 0) {
+		void *table_paddr = phys_alloc_page();
+		if (table_paddr == nullptr) return nullptr;
 
-		pde->val = (uint) phys_alloc_page() | attributes;
+		pde->val = (uint) table_paddr | attributes;
 
-	}	
+		// new page tables can have stale entries from the frame's last owner
+		memset(get_pte((void *) ((uint) vaddr & 0xFFC00000)), 0, sizeof(PageTable));
+
+		MemStats *stats = user_stats(vaddr);
+		if (stats != nullptr) stats->page_table_pages++;
+	} else if (pde->pagesize) {
+		if (!split_large_page(pde, vaddr)) return nullptr;
+	}
 
 	// ptr to page table entry containing vaddr:
 	return get_pte(vaddr);
@@ -194,19 +677,36 @@ PageMapEntry *ensure_pte(void *vaddr, uint attributes) {
 
 
 void *map_to(void *vaddr, void *p_addr, uint attributes) {
+	TLBFlush tlb;
+	void *mapped = remap(vaddr, p_addr, attributes, &tlb);
+	tlb.flush();
 
-	// ptr to page map entries containing vaddr:
-	PageMapEntry *pte = ensure_pte(vaddr, attributes);
-
-	pte->val = (uint) p_addr | attributes;
-	
-	return vaddr;
+	return mapped;
 }
 
 void *map_to(void *vaddr, void *p_addr) {
 	return map_to(vaddr, p_addr, PAGE_USER_DATA);
 }
 
+void *map_large(void *vaddr, void *p_addr, uint attributes) {
+	// returns nullptr if the CPU can't do 4MB pages, so the caller can fall back to `map_to()`
+	if (!has_pse) return nullptr;
+
+	PageMapEntry *pde = get_pde(vaddr);
+
+	// a page table that was here is no longer needed
+	if (pde->present && !pde->pagesize) {
+		page_unref((void *) (pde->val & 0xFFFFF000));
+	}
+
+	pde->val = ((uint) p_addr & 0xFFC00000) | attributes | PAGE_LARGE;
+
+	__asm__ volatile("invlpg %0"::"m" (*(char *) vaddr):"memory");
+	__asm__ volatile("invlpg %0"::"m" (*(char *) &page_tables[get_pde_index(vaddr)]):"memory");
+
+	return vaddr;
+}
+
 
 
 void *get_physical(void *vaddr) {
@@ -215,6 +715,10 @@ void *get_physical(void *vaddr) {
 	PageMapEntry *pte = get_pte(vaddr);
 	if (pte == nullptr) return nullptr;
 
+	if (get_pde(vaddr)->pagesize) {
+		// a 4MB PDE: the page's offset inside it comes from `vaddr`
+		return (void *) (((uint) pte->val & 0xFFC00000) | ((uint) vaddr & 0x003FF000));
+	}
 	return (void *) ((uint) pte->val & 0xFFFFF000);
 }
 
@@ -232,7 +736,74 @@ void *static_alloc_pages(uint pages) {
 }
 
 
-PageFrame *page_copy_ptr;
+static void drop_error_code() {
+	// the CPU pushed an error code on top of the usual interrupt frame, remove it before `iret`
+	ThreadState *state = thisThread->cpuState;
+
+	if ((state->pfParams.cs & 3) == 0) {
+		// no stack switch, so there's no ss:esp and the interrupted code's stack ends right after eflags.
+		// slide the saved registers up over the error code instead
+		uint *src = (uint *) state;
+		uint *dst = src + 1;
+		for (int i = 7; i >= 0; i--) dst[i] = src[i];
+
+		thisThread->cpuState = (ThreadState *) dst;
+	} else {
+		// shift int stack to remove error code
+		state->intParams = *(InterruptParams *) &state->pfParams.eip;
+	}
+}
+
+static bool handle_demand_fault(uint cr2) {
+	// map a zeroed frame if `cr2` was reserved with PAGE_DEMAND
+	// returns false if this isn't a demand page
+	PageMapEntry *pde = get_pde((void *) cr2);
+	if (pde->present == 0) return false;
+
+	PageMapEntry *pte = get_pte((void *) cr2);
+	if ((pte->present != 0) || ((pte->val & PAGE_DEMAND) == 0)) return false;
+
+	void *phys_page = phys_alloc_zeroed_page();
+	if (phys_page == nullptr) return false;
+
+	// the entry was not present, so there's nothing stale in the TLB
+	uint attributes = (pte->val & 0xFFF & ~PAGE_DEMAND) | PAGE_PRESENT;
+	pte->val = (uint) phys_page | attributes;
+
+	MemStats *stats = user_stats((void *) cr2);
+	if (stats != nullptr) {
+		stats->resident_pages++;
+		stats->demand_faults++;
+	}
+
+	debug(9, "Demand page vaddr=", (hex) cr2, " paddr=", (hex) phys_page);
+	return true;
+}
+
+static bool copy_cow_page(PageMapEntry *pte, uint cr2) {
+	// give the faulting process its own copy of a COW page, unless it's the last one sharing the frame
+	// returns false if the page is still shared and there's no frame to copy it into
+	void *old_phys_page = (void *) (pte->val & 0xFFFFF000);
+
+	// we're the last one using the frame and can just take it over
+	if (page_refcount(old_phys_page) == 1) return true;
+
+	void *new_phys_page = phys_alloc_page(); 
+	if (new_phys_page == nullptr) return false;
+
+	// the new frame isn't mapped yet, borrow this CPU's copy slot for it
+	void *cr2_page = (void *) (cr2 & 0xFFFFF000);
+	page_copy(kmap(KMAP_COPY, new_phys_page), cr2_page);
+	kunmap(KMAP_COPY);
+
+	pte->page = (uint) new_phys_page >> 12;
+
+	// other threads of this process may still use the old frame through their CPU's TLB, so it's only let go after the flush
+	if (cpus_online & ~(1 << this_cpu()->id)) flush_remote_tlbs();
+	page_unref(old_phys_page);
+
+	return true;
+}
 
 INTERRUPT_DEFINITION(page_fault_handler) {
 	ushort old_es;
@@ -249,31 +820,27 @@ INTERRUPT_DEFINITION(page_fault_handler) {
 
 	PageFaultParams *intArgs = &thisThread->cpuState->pfParams;
 
-	if (intArgs->code == 0x07) {
+	if ((intArgs->code & 1) == 0) {
+		// page not present
+		if (handle_demand_fault(cr2)) {
+			drop_error_code();
+			__asm__ volatile("movw %[old_es], %%es"::[old_es] "r" (old_es));
+			return;
+		}
+	} else if (intArgs->code == 0x07) {
 		// `code` would be 6 if page was not present, so its safe to get the PTE:
 		PageMapEntry *pte = get_pte((void *) cr2);
 	
-		if ((pte->val & 0xFFF) == PAGE_COW) {
-		// Page is copy-on-write
-
-			// `page_copy_ptr` lets us see both src and dst pages for copying:
-			int *cr2_page = (int *) ((uint) cr2 & 0xFFFFF000);
-			void *new_phys_page = phys_alloc_page(); 
-			map_to(page_copy_ptr, new_phys_page);
-
-			// copy page data:
-			// TODO this is slow. schedule this in a syscall thread or something
-			for (int i = 0; i< 1024; i++) {
-				((int *) page_copy_ptr)[i] = cr2_page[i];
-			}
+		// Page is copy-on-write. If there's no frame to copy it into, the thread can't go on
+		if (((pte->val & 0xFFF) == PAGE_COW) && copy_cow_page(pte, cr2)) {
+			thisProc->mem_stats.cow_faults++;
 
-			pte->page = (uint) new_phys_page >> 12;
-			// set page to writable:
+			// set page to writable, and clear the cache-disable bit that marked it COW:
 			pte->write = 1;
+			pte->cachedisable = 0;
+
+			drop_error_code();
 
-			// shift int stack to remove error code
-			thisThread->cpuState->intParams = *(InterruptParams *) &thisThread->cpuState->pfParams.eip; 
-			
 			__asm__ volatile(
 				"movw %[old_es], %%es\n"
 				"mfence\n"
@@ -284,22 +851,135 @@ INTERRUPT_DEFINITION(page_fault_handler) {
 			);
 			return;	
 		}
+
+		if (pte->write && pte->user) {
+			// another CPU already broke the COW, this CPU's TLB just hadn't seen it yet
+			drop_error_code();
+
+			__asm__ volatile(
+				"movw %[old_es], %%es\n"
+				"invlpg %[page]\n"
+				::
+				[old_es] "r" (old_es),
+				[page] "m" (*(int *)cr2)
+			);
+			return;
+		}
 	}
 	debug(0, "PAGE INTERRUPT");
-	debug(0, "CR2=", (hex) cr2, " procID=", (hex) proc_id, " threadID=", (hex) thisProc->thread_index);
+	debug(0, "CR2=", (hex) cr2, " procID=", (hex) proc_id, " threadID=", (hex) thisThread->index);
 	debug(0, " thread stack@", (hex) thisThread->stack, " bytes=", (hex) thisThread->stack_bytes);
 
 	intArgs->dump();
 	thisThread->cpuState->dump();
-	debug(0, "KILL THREAD: proc_id=", (hex) proc_id, " thread_id=", (hex) thisProc->thread_index);
+	debug(0, "KILL THREAD: proc_id=", (hex) proc_id, " thread_id=", (hex) thisThread->index);
 	// TODO kill thread and continue
 	SPINJMP();
 }
 
-int initialize_memory(void *phys_base_free) {
+#ifdef BENCHMARK_TLB
+
+static uint time_context_switches(uint cr4) {
+	// average cycles for a CR3 reload followed by touching the kernel pages a switch usually needs
+	const int switches = 256;
+
+	// kernel image, this CPU's data, the page table window and the start of VRAM
+	volatile char *touch[] = {
+		(char *) 0x7E00, (char *) 0x8E00, (char *) 0x9E00, (char *) 0xAE00,
+		(char *) cpus, (char *) page_refs, (char *) page_tables, (char *) page_dir,
+		(char *) 0xE0000000, (char *) 0xE0001000, (char *) 0xE0002000, (char *) 0xE0003000,
+	};
+	const int num_touch = sizeof(touch) / sizeof(touch[0]);
+
+	uint flags = irq_save();
+	// changing PGE flushes the whole TLB, global entries included
+	write_cr4(cr4);
+
+	uint cr3;
+	__asm__ volatile("movl %%cr3, %0":"=r"(cr3));
+
+	unsigned long long start = __builtin_ia32_rdtsc();
+	for (int s = 0; s < switches; s++) {
+		__asm__ volatile("movl %0, %%cr3"::"r"(cr3):"memory");
+		for (int t = 0; t < num_touch; t++) {
+			(void) *touch[t];
+		}
+	}
+	unsigned long long cycles = __builtin_ia32_rdtsc() - start;
+
+	irq_restore(flags);
+	return (uint) (cycles / switches);
+}
+
+void benchmark_tlb() {
+	uint cr4 = read_cr4();
+
+	uint without_pge = time_context_switches(cr4 & ~CR4_PGE);
+	uint with_pge = time_context_switches(cr4 | CR4_PGE);
+
+	// leave PGE as we found it
+	write_cr4(cr4);
+
+	debug(0, "TLB benchmark, cycles per switch: without PGE=", (int) without_pge, " with PGE=", (int) with_pge);
+}
+
+#endif
+
+static uint count_frames(E820Entry *memmap, uint memmap_entries) {
+	// one past the highest usable frame below 4GB, in whole 4MB regions (the buddy allocator works in those)
+	if (memmap_entries == 0) return PAGE_BITMAP_BITS;
+
+	unsigned long long top = 0;
+	for (uint e = 0; e < memmap_entries; e++) {
+		if (memmap[e].type != E820_USABLE) continue;
+
+		unsigned long long end = memmap[e].base + memmap[e].length;
+		if (end > top) top = end;
+	}
+	if (top > (1ULL << 32)) top = (1ULL << 32);
+
+	uint frames = (uint) ((top + (1 << 22) - 1) >> 22) * 1024;
+	// at least the kernel's low 4MB
+	if (frames < 1024) frames = 1024;
+	return frames;
+}
+
+static void reserve_holes(E820Entry *memmap, uint memmap_entries) {
+	// only frames that the BIOS says are usable RAM stay free
+	if (memmap_entries == 0) return;
+
+	uint frames = page_allocator->max_bits;
+	page_allocator->lock_bit_range(0, frames);
+
+	// usable entries first, only whole frames
+	for (uint e = 0; e < memmap_entries; e++) {
+		if (memmap[e].type != E820_USABLE) continue;
+
+		unsigned long long start = (memmap[e].base + sizeof(PageFrame) - 1) / sizeof(PageFrame);
+		unsigned long long end = (memmap[e].base + memmap[e].length) / sizeof(PageFrame);
+		if (end > frames) end = frames;
+		if (start >= end) continue;
+
+		page_allocator->unlock_bit_range((uint) start, (uint) (end - start));
+	}
+
+	// then anything reserved, in case it overlaps a usable entry
+	for (uint e = 0; e < memmap_entries; e++) {
+		if (memmap[e].type == E820_USABLE) continue;
+
+		unsigned long long start = memmap[e].base / sizeof(PageFrame);
+		unsigned long long end = (memmap[e].base + memmap[e].length + sizeof(PageFrame) - 1) / sizeof(PageFrame);
+		if (end > frames) end = frames;
+		if (start >= end) continue;
+
+		page_allocator->lock_bit_range((uint) start, (uint) (end - start));
+	}
+}
+
+int initialize_memory(void *phys_base_free, E820Entry *memmap, uint memmap_entries) {
 // phys_base_free must point to free physical memory to fit:
-// sizeof(PageAllocator) + 2 * 4096 bytes
-// the page_allocator takes up ~130kb
+// the page_allocator, `page_refs` and 2 * 4096 bytes
+// both are sized by the highest usable frame in `memmap`; with 4GB of RAM (or no memory map at all) that's ~130kb and 1MB
 // the other 2 pages are for the first page table and page directory
 // returns 1 for success, 0 for failure
 
@@ -315,15 +995,23 @@ int initialize_memory(void *phys_base_free) {
 	phys_alloc_ptr += 2 * sizeof(PageFrame);
 
 
+	uint frames = count_frames(memmap, memmap_entries);
+
 	uint bitset_blocks = phys_alloc_ptr;
 	// in case we need it again:
-	phys_alloc_ptr += PAGE_BITMAP_BYTES;
+	phys_alloc_ptr += BitAllocator<>::storage_bytes(frames);
+
+	page_allocator = new ((void *)bitset_blocks) BitAllocator<>(frames);
+	reserve_holes(memmap, memmap_entries);
 
-	page_allocator = (BitAllocator<> *) new ((void *)bitset_blocks) BitAllocator<PAGE_BITMAP_BITS>();
+	// one byte for every frame, right after the bitmap
+	page_refs = (volatile uchar *) phys_alloc_ptr;
+	memset((void *) page_refs, 0, frames);
+	phys_alloc_ptr += frames;
 
 	{
 		uint bit_start = bitset_blocks / sizeof(PageFrame);
-		uint bit_end = (bitset_blocks + PAGE_BITMAP_BYTES + (sizeof(PageFrame) - 1)) / sizeof(PageFrame);
+		uint bit_end = (phys_alloc_ptr + (sizeof(PageFrame) - 1)) / sizeof(PageFrame);
 		page_allocator->lock_bit_range(bit_start, bit_end - bit_start);
 	}
 
@@ -367,6 +1055,17 @@ int initialize_memory(void *phys_base_free) {
 	setPageDirectory(cr3);
 	enablePaging();
 
+	// keep PAGE_GLOBAL TLB entries (kernel, page tables of the kernel window, devices) across CR3 reloads
+	if (cpuid_features() & CPUID_PGE) {
+		write_cr4(read_cr4() | CR4_PGE);
+	}
+
+	// allow 4MB pages for `map_large()`
+	has_pse = (cpuid_features() & CPUID_PSE) != 0;
+	if (has_pse) {
+		write_cr4(read_cr4() | CR4_PSE);
+	}
+
 	/* Now that paging is on, we deal in virtual addresses */
 	// figure out the virtual addresses of the page table array
 	PageTable *v_ptables = (PageTable * ) (PDIR_SELF_INDEX * sizeof(PageTable) * 1024);
@@ -375,14 +1074,25 @@ int initialize_memory(void *phys_base_free) {
 	static_alloc_ptr = (uint) (phys_alloc_ptr + 4095) & 0xFFFFF000;
 	static_alloc_limit = (uint) v_ptables;
 
-	/* virtual memory becomes available after the page table array */
-	virt_alloc_ptr = (uint) v_ptables + sizeof(PageTable) * 1024;
-
 	page_tables = v_ptables;
 	page_dir = &v_ptables[PDIR_SELF_INDEX];
 
-	// allocate a virtual address for copying copy-on-write pages
-	page_copy_ptr = (PageFrame *) static_alloc_pages(1);
+	init_buddy_allocator();
+	init_percpu();
+
+	// create the kernel window's page tables now, so every process we create later inherits them
+	for (uint vaddr = KERNEL_VIRT_BASE; vaddr < KERNEL_VIRT_LIMIT; vaddr += sizeof(PageTable) * 1024) {
+		ensure_pte((void *) vaddr, PAGE_GLOBAL_DATA);
+	}
+
+	init_slab();
+	init_vmspace();
+	init_kmalloc();
+
+	// each CPU's `kmap()` slots
+	for (int c = 0; c < MAX_CPUS; c++) {
+		cpus[c].kmap_slots = (PageFrame *) next_kernel_pages(KMAP_SLOTS);
+	}
 
 	// set page fault handler
 	idt->table[0x0E].set_handler((void *) page_fault_handler);
@@ -0,0 +1,85 @@
+#include <new>
+#include <std/types.h>
+#include <std/string.h>
+#include <memory.h>
+#include <threads.h>
+#include <percpu.h>
+
+PerCPU *cpus;
+
+volatile uint cpus_online;
+
+struct __attribute__((packed)) GDTR {
+	ushort limit;
+	uint base;
+};
+
+static unsigned long long gdt_entry(uint base, uint limit, uint access, uint flags) {
+	// segment descriptor, `flags` is the upper nibble of byte 6
+	return (unsigned long long) (limit & 0xFFFF)
+		| ((unsigned long long) (base & 0xFFFFFF) << 16)
+		| ((unsigned long long) access << 40)
+		| ((unsigned long long) ((limit >> 16) & 0xF) << 48)
+		| ((unsigned long long) flags << 52)
+		| ((unsigned long long) (base >> 24) << 56);
+}
+
+void load_percpu(PerCPU *cpu) {
+	GDTR gdtr;
+	gdtr.limit = sizeof(cpu->gdt) - 1;
+	gdtr.base = (uint) cpu->gdt;
+
+	__asm__ volatile("lgdt %0"::"m"(gdtr):"memory");
+	__asm__ volatile("movw %w0, %%gs"::"r"(PERCPU_SELECTOR):"memory");
+	__asm__ volatile("ltr %w0"::"r"(TSS_SELECTOR));
+}
+
+void init_percpu() {
+	uint pages = (sizeof(PerCPU) * MAX_CPUS + 4095) / 4096;
+	cpus = (PerCPU *) static_alloc_pages(pages);
+
+	TSS *tss_table = (TSS *) static_alloc_pages((sizeof(TSS) * MAX_CPUS + 4095) / 4096);
+
+	// start from the GDT that boot_stub.nasm loaded
+	GDTR boot_gdtr;
+	__asm__ volatile("sgdt %0":"=m"(boot_gdtr));
+	uint boot_entries = (boot_gdtr.limit + 1) / sizeof(unsigned long long);
+	if (boot_entries > GDT_ENTRIES) boot_entries = GDT_ENTRIES;
+
+	for (int c = 0; c < MAX_CPUS; c++) {
+		PerCPU *cpu = &cpus[c];
+		cpu->self = cpu;
+		cpu->id = c;
+		cpu->thread = nullptr;
+		cpu->proc = nullptr;
+		cpu->pid = 0;
+		cpu->idle_thread = nullptr;
+		cpu->need_resched = false;
+		cpu->apic_id = 0;
+		cpu->slice_left = 0;
+		cpu->interrupt_stack = nullptr;
+		cpu->syscall_entry_stack = nullptr;
+		cpu->syscall_esp = 0;
+		cpu->page_cache.count = 0;
+		cpu->zero_pool.count = 0;
+		cpu->kmap_slots = nullptr;
+
+		TSS *tss = &tss_table[c];
+		memset(tss, 0, sizeof(TSS));
+		tss->ss0 = 0x10;
+		// no I/O permission bitmap
+		tss->iomap_base = sizeof(TSS);
+		cpu->tss = tss;
+
+		memset(cpu->gdt, 0, sizeof(cpu->gdt));
+		memcpy(cpu->gdt, (void *) boot_gdtr.base, boot_entries * sizeof(unsigned long long));
+
+		// available 32-bit TSS
+		cpu->gdt[TSS_SELECTOR / 8] = gdt_entry((uint) tss, sizeof(TSS) - 1, 0x89, 0x0);
+		// ring 0 data, 32-bit, byte granular
+		cpu->gdt[PERCPU_SELECTOR / 8] = gdt_entry((uint) cpu, sizeof(PerCPU) - 1, 0x92, 0x4);
+	}
+
+	cpus_online = 1;
+	load_percpu(&cpus[0]);
+}
@@ -5,6 +5,7 @@
 #include <devices/vga.h>
 #include <memory.h>
 #include <process.h>
+#include <scheduler.h>
 #include <syscall.h>
 
 #pragma push_macro("DEBUG_LEVEL")
@@ -13,179 +14,77 @@
 
 
 File nullfile;
-volatile uint proc_id;
 uint num_procs;
-Process *thisProc;
 Process *procs;
 
-volatile TSS *tss;
-
-void Process::lock(Lock *lock) {
-// wait on mutex. threads wait in FIFO order
-
-	cli();
-
-	// check for waiting threads
-
-	if ((lock->owner == thisThread) || (lock->owner == nullptr)) {
-	// if we have the lock or its free:
-
-		lock->owner = thisThread;
-
-		sti();
-
-		return;
-	}
-
-	debug(9, "Lock owned by thread@", (hex) lock->owner);
-
-	thisThread->lock_next = nullptr;
-
-	if (lock->next == nullptr) {
-	// if no other thread is waiting
-
-		debug(9, "starting wait queue lock->next=", (hex) thisThread);
-
-		lock->next = thisThread;
-
-	} else {
-	// else, append this thread to the queue
-
-		Thread *tnode = lock->next;
-
-		// go to second-last node 
-		for (;tnode->lock_next != nullptr; tnode = tnode->lock_next);
-
-		tnode->lock_next = thisThread;
-		debug(9, "adding to queue: thread=", (hex) thisThread);
-	}
-
-	thisThread->runState = WAITING;
-	this->num_running_threads--;
-	sti();
+bool Process::lock(Lock *lock, uint timeout_ms) {
+	return this->lock_until(lock, (timeout_ms != 0) ? deadline_after(timeout_ms) : 0);
+}
 
-	yield();
+bool Process::lock_until(Lock *lock, unsigned long long deadline) {
+// wait on mutex. threads wait in FIFO order, see locks.h
+// a `deadline` of 0 waits forever, otherwise returns false if the TSC passes it first
+	return lock_acquire(lock, deadline);
 }
 
 void Process::unlock(Lock *lock) {
-// release lock and wake the next waiting thread
-
-	cli();
-
-// release lock and wake the next waiting thread
-
-
-	lock->owner = lock->next;
-
-	if (lock->owner != nullptr) {
-	// wake next waiting thread if there is one:
-
-		lock->owner->runState = RUNNING;
-
-		lock->next = lock->owner->lock_next;
-
-		lock->owner->lock_next = nullptr;;
-
-	}
-
-	sti();
-
+// release lock and hand it to the next waiting thread
+	lock_release(lock);
 }
 
 void Process::send_msg(Message *msg) {
 	env->msgQueue.enqueue(msg);	
 
-	(*msg_signal)++;
+	// wakes the thread waiting for messages, if there is one
+	notify(MSG_MONITOR);
 }
 
-void Process::monitor(int monitor_h, int diff) {
+bool Process::monitor(int monitor_h, int diff, uint timeout_ms) {
 /*
 
  Monitor signal for a positive value, subtract up to `diff` from the signal
 
  The currently executing thread will block until `this` process owns `mon->lock` and `mon->signal` is signalled.
+ Any number of threads can wait, each gives up the lock while it waits for the signal.
 
  The current thread doesn't need to belong to `this` process, eg. so kernel threads can execute in any process context while using `procs[0]` for monitors etc.
 
  The lock remains locked after the signal is raised
 
-*/
+ A non-zero `timeout_ms` covers both waits. Returns false if it runs out, without the lock
 
-	cli();
-
-	Monitor *mon = this->get_monitor(monitor_h);
-
-	this->lock(&mon->lock);
-
-	if (mon->lock.owner != thisThread) {
-	// if somehow we didn't acquire the lock
-	// TODO wait timeout
-		return;
-	}
-	if (mon->signal <= 0) {
-
-		thisThread->signal_wait = &mon->signal;
-
-		thisThread->runState = WAITING;
-
-		this->num_running_threads--;
-
-		sti();
-
-		yield();
-
-		cli();
-
-	}
-
-	mon->signal -= diff;
-
-	// clamp to 0
-	if (mon->signal < 0) mon->signal = 0;
+*/
 
-	sti();
+	unsigned long long deadline = (timeout_ms != 0) ? deadline_after(timeout_ms) : 0;
 
-	// keep ownership of lock
+	return monitor_enter(this->get_monitor(monitor_h), diff, deadline);
 }
 
 void Process::unmonitor(int monitor_h) {
-	cli();
-
-	Monitor *mon = thisProc->get_monitor(monitor_h);
-
-	this->unlock(&mon->lock);
+	Monitor *mon = this->get_monitor(monitor_h);
 
-	sti();
+	lock_release(&mon->lock);
 }
 
 void Process::notify(int monitor_h, int diff) {
-// notify only the single thread listening on `monitor`
+// wake up to `diff` threads waiting on `monitor`
 // diff should probably be >0 for this to make sense
-	cli();
-
-	Monitor *mon = this->get_monitor(monitor_h);
-
-	mon->signal += diff;
-
-	if (mon->signal > 0) {
-	// only one thread can have a lock on the monitor, so only signal that thread:
-
-		Thread *owner = mon->lock.owner;
+	monitor_notify(this->get_monitor(monitor_h), diff);
+}
 
-		if ((owner != nullptr) && (owner->signal_wait == &mon->signal)){
+uint Process::wait_any(const int *monitor_hs, uint count, uint timeout_ms) {
+	if (count > MAX_WAIT_ANY) count = MAX_WAIT_ANY;
 
-			owner->signal_wait = nullptr;
-			owner->runState = RUNNING;
-			this->num_running_threads++;
+	Monitor *mons[MAX_WAIT_ANY];
+	for (uint m = 0; m < count; m++) mons[m] = this->get_monitor(monitor_hs[m]);
 
-		}
+	unsigned long long deadline = (timeout_ms != 0) ? deadline_after(timeout_ms) : 0;
 
-	}
+	return monitor_wait_any(mons, count, deadline);
 }
 
 void init_processes() {
-	tss = (volatile TSS *) 0xD00;
-	tss->ss0 = 0x10;
+	init_locks();
 
 	int proc_pages = (sizeof(Process) * MAX_PROCS + 4095) / sizeof(PageFrame);
 	procs = (Process *) static_alloc_pages(proc_pages);
@@ -193,15 +92,46 @@ void init_processes() {
 	// fill in threads
 	for (int p = 0; p < MAX_PROCS; p++) {
 		procs[p].num_running_threads = 0;
+
+		for (int l = 0; l < MAX_PROC_LOCKS; l++) procs[p].locks[l].init();
+		for (int m = 0; m < MAX_PROC_MONITORS; m++) procs[p].monitors[m].init();
+		for (int r = 0; r < MAX_PROC_RWLOCKS; r++) procs[p].rwlocks[r].init();
+		for (int s = 0; s < MAX_PROC_SEMAPHORES; s++) procs[p].semaphores[s].init();
+
+		procs[p].thread_lock.init();
+		procs[p].thread_exited.init();
+		procs[p].stack_cache.num_stacks = 0;
+		procs[p].stack_cache.num_syscall_stacks = 0;
+
 		Monitor *msg_mon = procs[p].get_monitor(MSG_MONITOR);
 
 		// cache these ptrs for event system
 		procs[p].msg_lock = &msg_mon->lock;
 		procs[p].msg_signal = &msg_mon->signal;
 
+		procs[p].vm.init(USER_VIRT_BASE, USER_VIRT_LIMIT);
+		memset(&procs[p].mem_stats, 0, sizeof(MemStats));
+
 		for (int t = 0; t < MAX_PROC_THREADS; t++) {
 			procs[p].threads[t].runState = ThreadRunState::NULL;
-			procs[p].thread_index = 0;
+			procs[p].threads[t].proc = &procs[p];
+			procs[p].threads[t].index = t;
+			procs[p].threads[t].base_priority = PRIORITY_DEFAULT;
+			procs[p].threads[t].inherited_priority = NUM_PRIORITIES;
+			procs[p].threads[t].priority = PRIORITY_DEFAULT;
+			procs[p].threads[t].queued = false;
+			procs[p].threads[t].timer_slot = -1;
+			procs[p].threads[t].timer_cpu = 0;
+			procs[p].threads[t].wait_next = nullptr;
+			procs[p].threads[t].wait_prev = nullptr;
+			procs[p].threads[t].wait_queue = nullptr;
+			procs[p].threads[t].blocked_on = nullptr;
+			procs[p].threads[t].held_locks = nullptr;
+			procs[p].threads[t].num_read_held = 0;
+			procs[p].threads[t].futex_next = nullptr;
+			procs[p].threads[t].futex_addr = nullptr;
+			procs[p].threads[t].on_cpu = false;
+			procs[p].threads[t].cpu = 0;
 
 			// init file table
 			for (int f = 0; f < MAX_PROC_FILES; f++) {
@@ -210,18 +140,21 @@ void init_processes() {
 		}
 	}
 
+	init_run_queues();
+
 	// Current process is the kernel, proc_id 0
 	num_procs = 1;
 	proc_id = 0;
 
 	thisProc = &procs[proc_id];
 	thisProc->cr3 = (uint) get_physical((void *) page_dir);
-	// Current thread is the kernel thread, index 0
-	thisProc->thread_index = 0;
 
-	thisThread = &thisProc->threads[thisProc->thread_index];
+	// Current thread is the kernel thread, index 0. It becomes the BSP's idle thread at the end of `_start()`
+	thisThread = &thisProc->threads[0];
+	this_cpu()->idle_thread = thisThread;
 	//TODO put this in a Thread function:
 	thisThread->runState = ThreadRunState::RUNNING;
+	thisThread->on_cpu = true;
 	thisProc->num_running_threads = 1;
 
 	thisProc->env = (Environment *) static_alloc_pages(1);
@@ -252,7 +185,8 @@ Process *new_user_process() {
 	}
 	num_procs++;
 
-	PageMapEntry *new_pdir = (PageMapEntry *) virt_alloc_page();
+	// kernel-only, and in the window every address space shares
+	PageMapEntry *new_pdir = (PageMapEntry *) virt_alloc_page(PAGE_KERNEL_DATA);
 	procs[new_pid].cr3 = (uint) get_physical(new_pdir);
 
 	// Copy mappings of global memory (kernel, mem-mapped devices, etc)
@@ -279,6 +213,7 @@ Process *new_user_process() {
 
 	// TODO use a whole 4mb page table, set global flag so it gets shared
 	thisProc->env = new (static_alloc_pages(1)) Environment();
+	thisProc->env->tsc_per_ms = tsc_per_ms;
 
 	// this gets mapped on demand
 	thisProc->userEnv = nullptr;
@@ -1,3 +1,4 @@
+#include <std/bitops.h>
 #include <interrupts.h>
 #include <scheduler.h>
 #include <events.h>
@@ -5,6 +6,7 @@
 #include <threads.h>
 #include <process.h>
 #include <devices/apic.h>
+#include <devices/pit.h>
 #include <devices/vga.h>
 
 #pragma push_macro("DEBUG_LEVEL")
@@ -12,107 +14,393 @@
 #define DEBUG_LEVEL 0
 
 #define TIMER_IDT 0xE0
+// `schedule()` raises this one itself
+#define SCHEDULE_IDT 0xE2
+// sent by `wake_thread()` to a CPU that should switch to the thread it just woke
+#define RESCHEDULE_IDT 0xE3
+
+RunQueue run_queues[MAX_CPUS];
+TimerHeap timer_heaps[MAX_CPUS];
+
+// measured against the PIT by `calibrate_timers()`
+uint tsc_per_ms;
+static uint lapic_per_ms;
+// LAPIC timer counts per TSC cycle, as a 0.32 fixed-point fraction
+static uint lapic_per_tsc;
+
+static inline unsigned long long rdtsc() {
+	return __builtin_ia32_rdtsc();
+}
+
+void TimerHeap::init(Thread **storage) {
+	lock.locked = 0;
+	slots = storage;
+	count = 0;
+}
+
+void TimerHeap::place(Thread *thread, uint slot) {
+	slots[slot] = thread;
+	thread->timer_slot = slot;
+}
 
-static int get_next_proc() {
+void TimerHeap::sift_up(uint slot) {
+	Thread *thread = slots[slot];
+	while (slot > 0) {
+		uint parent = (slot - 1) / 2;
+		if (slots[parent]->deadline <= thread->deadline) break;
+		place(slots[parent], slot);
+		slot = parent;
+	}
+	place(thread, slot);
+}
+
+void TimerHeap::sift_down(uint slot) {
+	Thread *thread = slots[slot];
+	for (;;) {
+		uint child = slot * 2 + 1;
+		if (child >= count) break;
+		if ((child + 1 < count) && (slots[child + 1]->deadline < slots[child]->deadline)) child++;
+		if (thread->deadline <= slots[child]->deadline) break;
+		place(slots[child], slot);
+		slot = child;
+	}
+	place(thread, slot);
+}
 
-	// check for kernel messages first
-	procs[0].notify(MSG_MONITOR, 0);
+void TimerHeap::insert(Thread *thread) {
+	place(thread, count);
+	count++;
+	sift_up(count - 1);
+}
 
+void TimerHeap::remove(Thread *thread) {
+	uint slot = thread->timer_slot;
+	thread->timer_slot = -1;
 
-	for (int i = 1; i < num_procs; i++) {
-		int next_proc_id = (proc_id + i) % num_procs;
-		Process *proc = &procs[next_proc_id];
+	count--;
+	if (slot == count) return;
 
+	// fill the hole with the last entry, which may have to move either way
+	Thread *moved = slots[count];
+	place(moved, slot);
+	sift_up(slot);
+	sift_down(moved->timer_slot);
+}
 
-		// if there's a message thread and there are messages, unblock the waiting thread
-		proc->notify(MSG_MONITOR, 0);
-		/*
-		Alternatively, in case the semaphore drifts from the value its tracking (# of msgs) we could adjust for the error: 
+uint TimerHeap::counts_to_next() {
+	if (count == 0) return 0;
 
-		int diff = proc->env->msgQueue.size() - *proc->msg_signal;
-		proc->notify(MSG_MONITOR, diff);
-		*/
+	unsigned long long now = rdtsc();
+	unsigned long long deadline = slots[0]->deadline;
+	if (deadline <= now) return 1;
 
+	// far-off deadlines just take a few wake-ups to reach
+	unsigned long long delta = deadline - now;
+	if (delta > 0xFFFFFFFFULL) delta = 0xFFFFFFFFULL;
 
-		debug(8, "    get_next_proc pid=", (hex) next_proc_id, " msgs=", (hex) *proc->msg_signal);
-		debug(8, "    running_threads=",(hex) proc->num_running_threads);
+	uint counts = (uint) ((delta * lapic_per_tsc) >> 32);
+	return (counts == 0) ? 1 : counts;
+}
 
-		if (proc->num_running_threads > 0) return next_proc_id;
+void RunQueue::init() {
+	mutex.locked = 0;
+	ready = 0;
+	for (int p = 0; p < NUM_PRIORITIES; p++) {
+		levels[p].head = nullptr;
+		levels[p].tail = nullptr;
 	}
+}
 
+void RunQueue::enqueue(Thread *thread) {
+	if (thread->queued) return;
 
-	// if no process has running threads, use the kernel process (procs[0])
-	// which contains the system idle thread (procs[0].threads[0])
-	return 0;
+	ThreadList *level = &levels[thread->priority];
+	thread->run_next = nullptr;
+	thread->run_prev = level->tail;
+	if (level->tail != nullptr) {
+		level->tail->run_next = thread;
+	} else {
+		level->head = thread;
+	}
+	level->tail = thread;
+
+	thread->queued = true;
+	ready |= (1 << thread->priority);
 }
 
-static int set_proc(int next_proc_id) {
-	int prev_proc_id = proc_id;
+void RunQueue::remove(Thread *thread) {
+	if (!thread->queued) return;
 
-	proc_id = next_proc_id;
+	ThreadList *level = &levels[thread->priority];
+	if (thread->run_prev != nullptr) {
+		thread->run_prev->run_next = thread->run_next;
+	} else {
+		level->head = thread->run_next;
+	}
+	if (thread->run_next != nullptr) {
+		thread->run_next->run_prev = thread->run_prev;
+	} else {
+		level->tail = thread->run_prev;
+	}
+	thread->run_next = nullptr;
+	thread->run_prev = nullptr;
 
-	thisProc = &procs[proc_id];
+	thread->queued = false;
+	if (level->head == nullptr) ready &= ~(1 << thread->priority);
+}
 
-	if (proc_id != 0) {
-		// context switch:
+Thread *RunQueue::pop() {
+	if (ready == 0) return nullptr;
 
-		uint old_cr3;
-		__asm__ volatile(
-			"movl %%cr3, %[old_cr3]"
-		:[old_cr3] "=r" (old_cr3));
+	Thread *thread = levels[bitscan_forward(ready)].head;
+	remove(thread);
+	return thread;
+}
 
-		// only set new cr3 if its different than current value
-		if (old_cr3 != thisProc->cr3) {
-			__asm__ volatile(
-				"movl %[newProcCR3], %%cr3"
-			::[newProcCR3] "r" (thisProc->cr3));
+Thread *RunQueue::steal() {
+	for (uint ready_levels = ready; ready_levels != 0; ready_levels &= ready_levels - 1) {
+		for (Thread *thread = levels[bitscan_forward(ready_levels)].head; thread != nullptr; thread = thread->run_next) {
+			if (thread->proc == &procs[0]) continue;
+			remove(thread);
+			return thread;
 		}
+	}
+	return nullptr;
+}
+
+void init_run_queues() {
+	// a thread is only ever in one heap, so each has room for all of them
+	uint heap_slots = MAX_PROCS * MAX_PROC_THREADS;
+	Thread **storage = (Thread **) static_alloc_pages((sizeof(Thread *) * heap_slots * MAX_CPUS + 4095) / 4096);
 
+	for (int c = 0; c < MAX_CPUS; c++) {
+		run_queues[c].init();
+		timer_heaps[c].init(&storage[c * heap_slots]);
 	}
+}
 
-	return prev_proc_id;
+static RunQueue *lock_queue_of(Thread *thread) {
+	// lock the queue `thread` belongs to, it can be stolen while we wait for the lock
+	for (;;) {
+		RunQueue *queue = &run_queues[thread->cpu];
+		queue->mutex.lock();
+		if (queue == &run_queues[thread->cpu]) return queue;
+		queue->mutex.unlock();
+	}
 }
 
-static int get_next_thread() {
+static void set_queued_priority(RunQueue *queue, Thread *thread, uint priority) {
+	// a queued thread has to move to its new level
+	if (thread->priority == priority) return;
 
-	// switch to next thread, round-robin
-	int index_start = 1 + thisProc->thread_index;
-	int index_end = index_start + MAX_PROC_THREADS;
+	bool queued = thread->queued;
+	queue->remove(thread);
+	thread->priority = priority;
+	if (queued) queue->enqueue(thread);
+}
 
-	for (int i = index_start; i < index_end; i++) {
-		int next_index = i % MAX_PROC_THREADS;
-		Thread *nextThread = &thisProc->threads[next_index];
+void set_thread_priority(Thread *thread, uint priority) {
+	if (priority >= NUM_PRIORITIES) priority = NUM_PRIORITIES - 1;
 
-		if (nextThread->runState == RUNNING) {
+	uint flags = irq_save();
+	RunQueue *queue = lock_queue_of(thread);
+	thread->base_priority = priority;
+	set_queued_priority(queue, thread, (priority < thread->inherited_priority) ? priority : thread->inherited_priority);
+	queue->mutex.unlock();
+	irq_restore(flags);
+}
+
+static void kick_idle_cpu() {
+	// idle CPUs don't tick, so wake one up to steal a thread that's left waiting behind a busy one
+	for (uint c = 0; c < MAX_CPUS; c++) {
+		PerCPU *cpu = &cpus[c];
+		if (!(cpus_online & (1 << c)) || (cpu->thread != cpu->idle_thread) || cpu->need_resched) continue;
+
+		cpu->need_resched = true;
+		if (cpu != this_cpu()) lapic->send_ipi(cpu->apic_id, ICR_ASSERT | ICR_FIXED | RESCHEDULE_IDT);
+		return;
+	}
+}
+
+static void request_preempt(Thread *woken) {
+	// have the CPU that owns `woken` switch to it as soon as it can, if it's more urgent than what that CPU is running
+	PerCPU *cpu = &cpus[woken->cpu];
+	Thread *running = cpu->thread;
+	if ((running != cpu->idle_thread) && (woken->priority >= running->priority)) {
+		// kernel threads can't move, see `RunQueue::steal()`
+		if ((woken->proc != &procs[0]) && (cpus_online & ~(1 << cpu->id))) kick_idle_cpu();
+		return;
+	}
+
+	cpu->need_resched = true;
+
+	// this CPU checks `need_resched` on its way out of the next interrupt or in `preempt_check()`
+	if (cpu != this_cpu()) lapic->send_ipi(cpu->apic_id, ICR_ASSERT | ICR_FIXED | RESCHEDULE_IDT);
+}
 
-			return next_index;
+void inherit_priority(Thread *thread, uint priority) {
+	uint flags = irq_save();
+	RunQueue *queue = lock_queue_of(thread);
+
+	uint prev = thread->inherited_priority;
+	thread->inherited_priority = priority;
+	uint effective = (priority < thread->base_priority) ? priority : thread->base_priority;
+
+	if (effective < thread->priority) {
+		set_queued_priority(queue, thread, effective);
+		// it's holding up something more urgent, so it may need to preempt whatever's running
+		if (thread->queued) request_preempt(thread);
+	} else if ((priority > prev) && (thread->priority < effective)) {
+		// the waiters it inherited from are gone, which also ends any boost
+		set_queued_priority(queue, thread, effective);
+	}
 
+	queue->mutex.unlock();
+	irq_restore(flags);
+}
+
+void wake_thread(Thread *thread, bool boost) {
+	uint flags = irq_save();
+	RunQueue *queue = lock_queue_of(thread);
+
+	if (thread->runState != RUNNING) {
+		if (boost) {
+			// user threads can't be boosted into the kernel's levels
+			uint floor = (thread->base_priority >= PRIORITY_USER_MAX) ? PRIORITY_USER_MAX : 0;
+			uint priority = thread->base_priority - PRIORITY_BOOST;
+			if ((thread->base_priority < PRIORITY_BOOST) || (priority < floor)) priority = floor;
+			if (priority < thread->priority) thread->priority = priority;
 		}
 
+		thread->runState = RUNNING;
+		__sync_fetch_and_add(&thread->proc->num_running_threads, 1);
 
+		// a thread that's still on a CPU goes back in the queue when that CPU next switches
+		if (!thread->on_cpu) {
+			queue->enqueue(thread);
+			request_preempt(thread);
+		}
 	}
 
-	// if we cannot find a running thread, just stick with the current thread (which would be in a WAITING loop from a call to yield() )
-	thisProc->num_running_threads = 0;
+	queue->mutex.unlock();
+	irq_restore(flags);
+}
+
+static void stop_thread(Thread *thread, ThreadRunState state) {
+	uint flags = irq_save();
+	RunQueue *queue = lock_queue_of(thread);
+
+	if (thread->runState == RUNNING) __sync_fetch_and_sub(&thread->proc->num_running_threads, 1);
+
+	thread->runState = state;
+	queue->remove(thread);
+
+	queue->mutex.unlock();
+	irq_restore(flags);
+}
+
+void block_thread(Thread *thread) {
+	stop_thread(thread, WAITING);
+}
+
+void finish_thread(Thread *thread) {
+	stop_thread(thread, DONE);
+}
+
+static Thread *steal_thread(PerCPU *cpu) {
+	// take a thread from the first other CPU that has one to spare
+	for (uint c = 0; c < MAX_CPUS; c++) {
+		if ((c == cpu->id) || !(cpus_online & (1 << c))) continue;
+
+		RunQueue *queue = &run_queues[c];
+		if (queue->ready == 0) continue;
+
+		queue->mutex.lock();
+		Thread *thread = queue->steal();
+		if (thread != nullptr) {
+			thread->cpu = cpu->id;
+			thread->on_cpu = true;
+		}
+		queue->mutex.unlock();
+
+		if (thread != nullptr) return thread;
+	}
+	return nullptr;
+}
+
+static Thread *get_next_thread(bool expired) {
+	// round-robin within the most urgent level that has runnable threads
+	PerCPU *cpu = this_cpu();
+	Thread *current = cpu->thread;
+	RunQueue *queue = &run_queues[cpu->id];
+
+	queue->mutex.lock();
+
+	// the current thread used up its timeslice, so any boost starts wearing off. Inherited priority stays while the waiters do
+	uint floor = (current->inherited_priority < current->base_priority) ? current->inherited_priority : current->base_priority;
+	if (expired && (current->priority < floor)) current->priority++;
+
+	// the BSP's idle thread only counts as runnable until it blocks at the end of `main()`
+	if (current->runState == RUNNING) queue->enqueue(current);
 
-	// if we're in the system thread, return the system idle thread id (0):
-	if (proc_id == 0) return 0;
+	// from here on another CPU may pick it up, its state is already saved
+	current->on_cpu = false;
 
-	return thisProc->thread_index;
+	Thread *next = queue->pop();
+	if (next != nullptr) next->on_cpu = true;
+
+	queue->mutex.unlock();
+
+	if (next == nullptr) next = steal_thread(cpu);
+	if (next == nullptr) {
+		next = cpu->idle_thread;
+		next->on_cpu = true;
+	}
+
+	return next;
 }
 
-static int set_thread(int next_index) {
+static int set_proc(int next_proc_id) {
+	PerCPU *cpu = this_cpu();
+	int prev_proc_id = cpu->pid;
+
+	cpu->pid = next_proc_id;
+
+	cpu->proc = &procs[next_proc_id];
+
+	if (next_proc_id != 0) {
+		// context switch:
+
+		uint old_cr3;
+		__asm__ volatile(
+			"movl %%cr3, %[old_cr3]"
+		:[old_cr3] "=r" (old_cr3));
+
+		// only set new cr3 if its different than current value
+		if (old_cr3 != cpu->proc->cr3) {
+			__asm__ volatile(
+				"movl %[newProcCR3], %%cr3"
+			::[newProcCR3] "r" (cpu->proc->cr3));
+		}
+
+	}
 
-	int prev_index = thisProc->thread_index;
+	return prev_proc_id;
+}
 
-	thisProc->thread_index = next_index;
+static Thread *set_thread(Thread *next) {
+	PerCPU *cpu = this_cpu();
+	Thread *prev = cpu->thread;
 
-	thisThread = &thisProc->threads[next_index];
+	cpu->thread = next;
 
 	//point ESP0 at end of thread stack
-	tss->esp0 = (uint) thisThread->stack + thisThread->stack_bytes;
+	cpu->tss->esp0 = (uint) next->stack + next->stack_bytes;
 
-	return prev_index;
+	// kernel threads never `sysenter`
+	if (next->proc != &procs[0]) cpu->syscall_esp = ((UserThread *) next)->syscall_esp;
+
+	return prev;
 }
 
 static unsigned long long old_tsc;
@@ -127,33 +415,176 @@ void kprint_process_tag() {
 	int tmp_buf_size = 64;
 	char tmp_buf[tmp_buf_size];
 	char *tmp_str = tmp_buf;
-	int len = sprint(tmp_str, tmp_buf_size, "P(", (int) proc_id, ":", (int) thisProc->thread_index, ":DT=", (hex)(uint) diff_tsc, ")");
+	int len = sprint(tmp_str, tmp_buf_size, "P(", (int) proc_id, ":", (int) thisThread->index, ":DT=", (hex)(uint) diff_tsc, ")");
 	tmp_buf[len] = 0;
 	rect_fill({850, 30, 850 + len * CHAR_SPACING_X, 30 + CHAR_SPACING_Y}, BLACK);
 	render_text_xy(tmp_buf, len, 850, 30, GREY);
 }
 
+static void arm_timer(PerCPU *cpu, uint slice) {
+	// one-shot until the end of `slice` or the first deadline, whichever comes first. A `slice` of 0 means no slice, for the idle thread
+	uint counts = slice;
+	uint timeout = timer_heaps[cpu->id].counts_to_next();
+	if ((timeout != 0) && ((counts == 0) || (timeout < counts))) counts = timeout;
+
+	cpu->slice_left = slice - counts;
+	if (slice == 0) cpu->slice_left = 0;
+
+	// 0 stops the timer
+	lapic->set_timer(counts);
+}
+
+static void fire_timeouts(PerCPU *cpu) {
+	TimerHeap *heap = &timer_heaps[cpu->id];
+	unsigned long long now = rdtsc();
+
+	heap->lock.lock();
+	while ((heap->count > 0) && (heap->slots[0]->deadline <= now)) {
+		Thread *thread = heap->slots[0];
+		heap->remove(thread);
+		thread->timed_out = true;
+		// still holding the heap lock, so `cancel_timeout()` can't return before this thread is awake
+		wake_thread(thread);
+	}
+	heap->lock.unlock();
+}
+
+static void switch_thread(bool expired) {
+	// pick the next thread, INTERRUPT_DEFINITION resumes whichever one `thisThread` is on the way out
+	PerCPU *cpu = this_cpu();
+	cpu->need_resched = false;
+
+	Thread *next = get_next_thread(expired);
+
+	set_proc(next->proc - procs);
+	set_thread(next);
+
+	// a fresh timeslice for whoever runs next
+	arm_timer(cpu, (next == cpu->idle_thread) ? 0 : timeslice(next->priority));
+}
+
 INTERRUPT_DEFINITION(timer_interrupt) {
 	lapic->send_eoi();
 
-// TODO thread timers for sleep() and WAIT timeouts
+	PerCPU *cpu = this_cpu();
+	fire_timeouts(cpu);
 
-	int pid = get_next_proc();
+	if ((cpu->thread != cpu->idle_thread) && (cpu->slice_left > 0)) {
+		// a deadline went off mid-slice, the current thread carries on
+		arm_timer(cpu, cpu->slice_left);
+	} else {
+		switch_thread(true);
+	}
+
+	// only one CPU draws, the rest would fight over the same pixels
+	if (this_cpu()->id == 0) kprint_process_tag();
+}
+
+INTERRUPT_DEFINITION(schedule_interrupt) {
+	// raised by `schedule()`, so there's no EOI to send
+	switch_thread(false);
+}
+
+INTERRUPT_DEFINITION(reschedule_interrupt) {
+	// nothing to do here, `interrupt_exit()` sees `need_resched`
+	lapic->send_eoi();
+}
+
+extern "C" void interrupt_exit() {
+	// every INTERRUPT_DEFINITION calls this after its handler: switch now if a wake-up asked for it
+	// but not out from under code that had interrupts disabled (a fault while holding a spinlock), it'll get there at `preempt_check()` or the next tick
+	if (this_cpu()->need_resched && (thisThread->cpuState->intParams.eflags & 0x200)) switch_thread(false);
+}
 
-	set_proc(pid);
-	int tid = get_next_thread();
+void schedule() {
+	__asm__ volatile("int %0"::"i"(SCHEDULE_IDT):"memory");
+}
 
-	set_thread(tid);
+void preempt_check() {
+	if (this_cpu()->need_resched) schedule();
+}
 
-	kprint_process_tag();
+unsigned long long deadline_after(uint ms) {
+	return rdtsc() + (unsigned long long) ms * tsc_per_ms;
+}
+
+void set_timeout(Thread *thread, unsigned long long deadline) {
+	// always on the calling CPU's heap, its timer is the one that will be re-armed
+	PerCPU *cpu = this_cpu();
+	TimerHeap *heap = &timer_heaps[cpu->id];
+
+	uint flags = irq_save();
+	heap->lock.lock();
+
+	thread->deadline = deadline;
+	thread->timed_out = false;
+	thread->timer_cpu = cpu->id;
+	heap->insert(thread);
+
+	heap->lock.unlock();
+	irq_restore(flags);
+}
+
+bool cancel_timeout(Thread *thread) {
+	uint flags = irq_save();
+	TimerHeap *heap = &timer_heaps[thread->timer_cpu];
+	heap->lock.lock();
+
+	bool pending = (thread->timer_slot >= 0);
+	if (pending) heap->remove(thread);
+
+	heap->lock.unlock();
+	irq_restore(flags);
+	return pending;
+}
+
+void sleep_thread(uint ms) {
+	// interrupts stay off until we've blocked, so the timeout can't fire before there's anything to wake
+	uint flags = irq_save();
+	set_timeout(thisThread, deadline_after(ms));
+	block_thread(thisThread);
+	irq_restore(flags);
+
+	yield();
+}
+
+static void calibrate_timers() {
+	// count TSC cycles and LAPIC timer ticks across 10ms of the PIT, with the timer's interrupt masked
+	lapic->timer_div = (uint) 0x08;
+	lapic->lvt_timer = (uint) lapic->lvt_timer | LVT_MASKED;
+	lapic->set_timer(0xFFFFFFFF);
+
+	unsigned long long tsc_start = rdtsc();
+	pit_delay(10000);
+	uint lapic_counts = 0xFFFFFFFF - (uint) lapic->timer_count;
+	uint tsc_cycles = (uint) (rdtsc() - tsc_start);
+
+	lapic->set_timer(0);
+
+	tsc_per_ms = tsc_cycles / 10;
+	lapic_per_ms = lapic_counts / 10;
+	lapic_per_tsc = div64((unsigned long long) lapic_per_ms << 32, tsc_per_ms);
+
+	debug(9, "TSC/ms=", tsc_per_ms, " LAPIC/ms=", lapic_per_ms);
+}
+
+void start_cpu_timer() {
+	// every CPU's LAPIC timer shares the bus clock measured by `calibrate_timers()`
+	lapic->timer_div = (uint) 0x08;
+	lapic->set_timer_vector(TIMER_IDT);
+	arm_timer(this_cpu(), timeslice(PRIORITY_DEFAULT));
 }
 
 void init_scheduler() {
 	old_tsc = __builtin_ia32_rdtsc();
 
+	calibrate_timers();
+
 	idt->table[TIMER_IDT].set_handler( (void *) timer_interrupt );
+	idt->table[SCHEDULE_IDT].set_handler( (void *) schedule_interrupt );
+	idt->table[RESCHEDULE_IDT].set_handler( (void *) reschedule_interrupt );
 
-	lapic->set_timer_vector(TIMER_IDT);
+	start_cpu_timer();
 }
 
 #pragma pop_macro("DEBUG_LEVEL")
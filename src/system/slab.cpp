@@ -0,0 +1,220 @@
+#include <new>
+#include <std/types.h>
+#include <std/bitset.h>
+#include <devices/cpu.h>
+#include <memory.h>
+#include <page.h>
+#include <slab.h>
+#include <util/debug.h>
+
+#pragma push_macro("DEBUG_LEVEL")
+
+#define DEBUG_LEVEL 0
+
+// slab pages live in their own part of the kernel window, one bit per page.
+// growing a cache can't go through `virt_alloc_pages()`, which needs a `VMArea` from a slab itself
+#define SLAB_WINDOW_PAGES ((KERNEL_VM_BASE - KERNEL_VIRT_BASE) / sizeof(PageFrame))
+
+static BitAllocator<SLAB_WINDOW_PAGES> *slab_pages;
+
+// the cache that `SlabCache` descriptors themselves come from
+static SlabCache cache_cache;
+
+static SlabCache *cache_chain;
+static SpinLock chain_mutex;
+
+void SlabList::push(Slab *slab) {
+	slab->prev = nullptr;
+	slab->next = head;
+	if (head != nullptr) head->prev = slab;
+	head = slab;
+}
+
+void SlabList::remove(Slab *slab) {
+	if (slab->prev != nullptr) {
+		slab->prev->next = slab->next;
+	} else {
+		head = slab->next;
+	}
+	if (slab->next != nullptr) slab->next->prev = slab->prev;
+
+	slab->next = nullptr;
+	slab->prev = nullptr;
+}
+
+void SlabCache::init(const char *name, uint size, void (*ctor)(void *)) {
+	this->name = name;
+	// objects must be able to hold the free list link
+	if (size < sizeof(void *)) size = sizeof(void *);
+	this->obj_size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	this->first_offset = (sizeof(Slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	this->objs_per_slab = (sizeof(PageFrame) - first_offset) / obj_size;
+	this->ctor = ctor;
+
+	mutex.locked = 0;
+	partial.head = nullptr;
+	full.head = nullptr;
+	empty.head = nullptr;
+	num_empty = 0;
+	next = nullptr;
+}
+
+static void *slab_page_alloc() {
+	int index = slab_pages->lock_next_bit(0);
+	if (index < 0) return nullptr;
+
+	PageFrame *page = &((PageFrame *) KERNEL_VIRT_BASE)[index];
+	if (virt_alloc_pages(1, page, PAGE_GLOBAL_DATA) == nullptr) {
+		slab_pages->unlock_bit(index);
+		return nullptr;
+	}
+	return page;
+}
+
+static void slab_page_free(void *page) {
+	virt_free_page(page);
+	slab_pages->unlock_bit(((uint) page - KERNEL_VIRT_BASE) / sizeof(PageFrame));
+}
+
+Slab *SlabCache::grow() {
+	// add a new empty slab, called with `mutex` held
+	Slab *slab = (Slab *) slab_page_alloc();
+	if (slab == nullptr) return nullptr;
+
+	slab->cache = this;
+	slab->in_use = 0;
+	slab->free_list = nullptr;
+
+	// build the free list back to front so objects are handed out in address order
+	char *objs = (char *) slab + first_offset;
+	for (int i = objs_per_slab - 1; i >= 0; i--) {
+		void **obj = (void **) &objs[i * obj_size];
+		*obj = slab->free_list;
+		slab->free_list = obj;
+	}
+
+	empty.push(slab);
+	num_empty++;
+
+	debug(9, "New slab for ", name, " @ ", (hex) slab);
+	return slab;
+}
+
+void *SlabCache::alloc() {
+	uint flags = irq_save();
+	mutex.lock();
+
+	Slab *slab = partial.head;
+	if (slab == nullptr) {
+		slab = empty.head;
+		if (slab == nullptr) slab = grow();
+		if (slab == nullptr) {
+			mutex.unlock();
+			irq_restore(flags);
+			return nullptr;
+		}
+		empty.remove(slab);
+		num_empty--;
+		partial.push(slab);
+	}
+
+	void **obj = (void **) slab->free_list;
+	slab->free_list = *obj;
+	slab->in_use++;
+
+	if (slab->in_use == objs_per_slab) {
+		partial.remove(slab);
+		full.push(slab);
+	}
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	if (ctor != nullptr) ctor(obj);
+
+	return obj;
+}
+
+void SlabCache::free(void *obj) {
+	Slab *slab = (Slab *) ((uint) obj & 0xFFFFF000);
+
+	uint flags = irq_save();
+	mutex.lock();
+
+	if (slab->in_use == objs_per_slab) {
+		full.remove(slab);
+		partial.push(slab);
+	}
+
+	*(void **) obj = slab->free_list;
+	slab->free_list = obj;
+	slab->in_use--;
+
+	Slab *release = nullptr;
+	if (slab->in_use == 0) {
+		partial.remove(slab);
+
+		if (num_empty < SLAB_MAX_EMPTY) {
+			empty.push(slab);
+			num_empty++;
+		} else {
+			release = slab;
+		}
+	}
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	if (release != nullptr) slab_page_free(release);
+}
+
+SlabCache *slab_cache_create(const char *name, uint size, void (*ctor)(void *)) {
+	// returns an existing cache for the same object size and constructor, or a new one
+	// returns nullptr if objects of `size` don't fit in a slab
+	if (size > SLAB_MAX_OBJ_SIZE) return nullptr;
+
+	uint obj_size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	if (obj_size < sizeof(void *)) obj_size = sizeof(void *);
+
+	uint flags = irq_save();
+	chain_mutex.lock();
+
+	SlabCache *cache = cache_chain;
+	for (; cache != nullptr; cache = cache->next) {
+		if ((cache->obj_size == obj_size) && (cache->ctor == ctor)) break;
+	}
+
+	if (cache == nullptr) {
+		cache = (SlabCache *) cache_cache.alloc();
+		if (cache != nullptr) {
+			cache->init(name, size, ctor);
+			cache->next = cache_chain;
+			cache_chain = cache;
+		}
+	}
+
+	chain_mutex.unlock();
+	irq_restore(flags);
+
+	return cache;
+}
+
+void *slab_alloc(SlabCache *cache) {
+	return cache->alloc();
+}
+
+void slab_free(void *obj) {
+	if (obj == nullptr) return;
+	Slab *slab = (Slab *) ((uint) obj & 0xFFFFF000);
+	slab->cache->free(obj);
+}
+
+void init_slab() {
+	slab_pages = new (static_alloc_pages((sizeof(BitAllocator<SLAB_WINDOW_PAGES>) + 4095) / sizeof(PageFrame))) BitAllocator<SLAB_WINDOW_PAGES>();
+
+	cache_cache.init("SlabCache", sizeof(SlabCache), nullptr);
+	cache_chain = &cache_cache;
+	chain_mutex.locked = 0;
+}
+
+#pragma pop_macro("DEBUG_LEVEL")
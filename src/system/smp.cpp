@@ -0,0 +1,205 @@
+#include <new>
+#include <std/types.h>
+#include <std/string.h>
+#include <std/bitops.h>
+#include <util/debug.h>
+#include <interrupts.h>
+#include <memory.h>
+#include <kmalloc.h>
+#include <percpu.h>
+#include <process.h>
+#include <threads.h>
+#include <scheduler.h>
+#include <syscall.h>
+#include <smp.h>
+#include <devices/cpu.h>
+#include <devices/apic.h>
+#include <devices/pit.h>
+
+#pragma push_macro("DEBUG_LEVEL")
+
+#define DEBUG_LEVEL 0
+
+// ap_boot.nasm
+extern "C" char ap_trampoline[];
+extern "C" char ap_trampoline_end[];
+extern "C" char ap_boot_data[];
+
+struct __attribute__((packed)) APBootData {
+// must match `ap_boot_data` in ap_boot.nasm
+	ushort gdt_limit;
+	uint gdt_base;
+	ushort padding;
+	uint cr0;
+	uint cr3;
+	uint cr4;
+	uint *stack_tops;
+	void (*entry)(uint id);
+	uint max_aps;
+	volatile uint count;
+};
+
+// one bit per CPU that still has to flush, see `flush_remote_tlbs()`
+static volatile uint tlb_pending;
+static volatile uint tlb_shootdown_lock;
+
+static void flush_local_tlb() {
+	// drop every entry, global ones included
+	uint cr4 = read_cr4();
+	if (cr4 & CR4_PGE) {
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+	} else {
+		uint cr3;
+		__asm__ volatile("mov %%cr3, %0":"=r"(cr3));
+		setPageDirectory(cr3);
+	}
+}
+
+static void service_tlb_shootdown() {
+	uint bit = 1 << this_cpu()->id;
+	if ((tlb_pending & bit) == 0) return;
+
+	flush_local_tlb();
+	__sync_fetch_and_and(&tlb_pending, ~bit);
+}
+
+INTERRUPT_DEFINITION(tlb_shootdown_interrupt) {
+	lapic->send_eoi();
+
+	service_tlb_shootdown();
+}
+
+void flush_remote_tlbs() {
+	uint flags = irq_save();
+
+	uint targets = cpus_online & ~(1 << this_cpu()->id);
+	if (targets == 0) {
+		irq_restore(flags);
+		return;
+	}
+
+	// one shootdown at a time. Whoever is waiting here has interrupts off, so it answers the current one itself
+	while (__sync_lock_test_and_set(&tlb_shootdown_lock, 1)) {
+		service_tlb_shootdown();
+		__asm__ volatile("pause");
+	}
+
+	__sync_fetch_and_or(&tlb_pending, targets);
+	lapic->send_ipi(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_FIXED | TLB_SHOOTDOWN_IDT);
+
+	while (tlb_pending & targets) __asm__ volatile("pause");
+
+	__sync_lock_release(&tlb_shootdown_lock);
+	irq_restore(flags);
+}
+
+extern "C" void ap_main(uint id) {
+	PerCPU *cpu = &cpus[id];
+
+	load_percpu(cpu);
+	load_idt();
+
+	init_syscall_cpu();
+
+	init_lapic();
+	cpu->apic_id = (uint) lapic->ID >> 24;
+	start_cpu_timer();
+
+	__sync_fetch_and_or(&cpus_online, 1 << id);
+
+	debug(9, "CPU ", (int) id, " online");
+
+	sti();
+
+	// this is now the idle thread, same as the end of `_start()`
+	for (;;) {
+		refill_zero_pool();
+		__asm__ volatile("hlt");
+	}
+}
+
+static void prepare_cpu(PerCPU *cpu, void *stack, uint stack_bytes) {
+	// everything an AP needs allocated before it starts, so `ap_main()` never has to allocate
+	cpu->interrupt_stack = (void *) ((uint) virt_alloc_pages(1, PAGE_KERNEL_DATA) + sizeof(PageFrame));
+	cpu->syscall_entry_stack = virt_alloc_pages(SYSCALL_STACK_PAGES, PAGE_KERNEL_DATA);
+
+	// the AP is already running on `stack` when it gets here, so this thread never needs a starting state
+	KernelThread *idle = (KernelThread *) kmalloc(sizeof(KernelThread));
+	memset(idle, 0, sizeof(KernelThread));
+	idle->setStack(stack, stack_bytes);
+	idle->runState = ThreadRunState::WAITING;
+	idle->proc = &procs[0];
+	idle->cpu = cpu->id;
+	idle->on_cpu = true;
+	idle->base_priority = NUM_PRIORITIES - 1;
+	idle->inherited_priority = NUM_PRIORITIES;
+	idle->priority = NUM_PRIORITIES - 1;
+	idle->timer_slot = -1;
+	idle->timer_cpu = cpu->id;
+
+	cpu->idle_thread = idle;
+	cpu->thread = idle;
+	cpu->proc = &procs[0];
+	cpu->pid = 0;
+}
+
+void init_smp() {
+	if ((cpuid_features() & CPUID_APIC) == 0) return;
+
+	// wake-ups on other CPUs send IPIs here by APIC ID
+	this_cpu()->apic_id = (uint) lapic->ID >> 24;
+
+#ifndef ENABLE_SMP
+	// off until the cross-CPU paths have been run under QEMU -smp, build with -DENABLE_SMP to start the APs
+	return;
+#endif
+
+	uint max_aps = MAX_CPUS - 1;
+	uint stack_bytes = AP_STACK_PAGES * sizeof(PageFrame);
+
+	uint *stack_tops = (uint *) kmalloc(sizeof(uint) * max_aps);
+	for (uint a = 0; a < max_aps; a++) {
+		void *stack = virt_alloc_pages(AP_STACK_PAGES, PAGE_KERNEL_DATA);
+		stack_tops[a] = (uint) stack + stack_bytes;
+		prepare_cpu(&cpus[a + 1], stack, stack_bytes);
+	}
+
+	idt->table[TLB_SHOOTDOWN_IDT].set_handler( (void *) tlb_shootdown_interrupt );
+
+	// the trampoline runs from low memory, which is identity mapped in every address space
+	uint trampoline_bytes = ap_trampoline_end - ap_trampoline;
+	memcpy((void *) AP_TRAMPOLINE, ap_trampoline, trampoline_bytes);
+
+	APBootData *boot = (APBootData *) (AP_TRAMPOLINE + (ap_boot_data - ap_trampoline));
+	__asm__ volatile("sgdt %0":"=m"(*boot));
+	boot->cr0 = read_cr0();
+	// the kernel's own page directory, whatever process the BSP happens to be in
+	boot->cr3 = procs[0].cr3;
+	boot->cr4 = read_cr4();
+	boot->stack_tops = stack_tops;
+	boot->entry = ap_main;
+	boot->max_aps = max_aps;
+	boot->count = 0;
+
+	// INIT, wait 10ms, then two startup IPIs (the second one is for CPUs that missed the first)
+	lapic->send_ipi(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_INIT);
+	pit_delay(10000);
+
+	for (int sipi = 0; sipi < 2; sipi++) {
+		lapic->send_ipi(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+		pit_delay(200);
+	}
+
+	// give the ones that took a number up to ~100ms to report in
+	for (int wait = 0; wait < 100; wait++) {
+		uint started = boot->count;
+		if (started > max_aps) started = max_aps;
+		if (cpus_online == low_ones(started + 1)) break;
+		pit_delay(1000);
+	}
+
+	debug(0, "CPUs online: ", (hex) cpus_online);
+}
+
+#pragma pop_macro("DEBUG_LEVEL")
@@ -38,18 +38,18 @@ extern "C" int strncmp(const char *a, const char *b, size_t len ) {
 }
 
 extern "C" void *memcpy(void *dst, void *src, size_t num) {
+	void *d = dst;
+	//process in 4-byte chunks, then the remainder
 	uint num_dwords = num / 4;
-	uint i = 0;
-	//process in 4-byte chunks
-	for (; i < num_dwords; i++) {
-		((uint *)dst)[i] = ((uint *)src)[i];
-	}
-	i *= 4; //multiply by dword size to get byte number
-
-	//remainder
-	for (; i < num; i++) {
-		((char *) dst)[i] = ((char *)src)[i];
-	}
+	uint remainder = num & 3;
+	__asm__ volatile(
+		"cld\n"
+		"rep movsl\n"
+		"movl %[remainder], %%ecx\n"
+		"rep movsb"
+	:"+D" (d), "+S" (src), "+c" (num_dwords)
+	:[remainder] "r" (remainder)
+	:"memory");
 	return dst;
 }	
 
@@ -60,19 +60,18 @@ extern "C" void *memset(void *buffer, int value, size_t num_chars) {
 	ch4 |= (ch4 << 16);
 	ch4 |= (ch4 << 8);
 
-	//process first in 4-byte chunks
+	//process first in 4-byte chunks, then the remainder
+	void *d = buffer;
 	uint num_dwords = num_chars >> 2;
-	int i=0;
-	for (; i < num_dwords; i++) {
-		((uint *)buffer)[i] = ch4;
-	}
-
-	i <<= 2;
-
-	//remainder
-	for (; i < num_chars; i++) {
-		((char *) buffer)[i] = (char) value;
-	}
+	uint remainder = num_chars & 3;
+	__asm__ volatile(
+		"cld\n"
+		"rep stosl\n"
+		"movl %[remainder], %%ecx\n"
+		"rep stosb"
+	:"+D" (d), "+c" (num_dwords)
+	:"a" (ch4), [remainder] "r" (remainder)
+	:"memory");
 	return buffer;
 }
 
@@ -7,7 +7,9 @@
 #include <page.h>
 #include <events.h>
 #include <locks.h>
+#include <futex.h>
 #include <process.h>
+#include <scheduler.h>
 #include <memory.h>
 #include <filesystem.h>
 
@@ -15,8 +17,6 @@
 #define DEBUG_LEVEL 0
 
 
-#define SYSCALL_STACK_PAGES 4
-
 
 // map of syscall codes to their corresponding functions
 SyscallPtr syscall_table[SyscallCode::MAX];
@@ -28,14 +28,56 @@ int syscall_null(uint data) {
 }
 
 int syscall_alloc(uint pages) {
+	if ((pages == 0) || (pages > (USER_VIRT_LIMIT - USER_VIRT_BASE) / sizeof(PageFrame))) return 0;
+
 	sti();
-	return (int) virt_alloc_pages(pages);
+	// frames are only allocated when each page is first touched
+	void *vaddr = virt_alloc_pages(pages, PAGE_USER_LAZY);
+	if (vaddr != nullptr) thisProc->mem_stats.alloc_bytes += pages * sizeof(PageFrame);
+	return (int) vaddr;
 }
 
 int syscall_alloc_at(SyscallAllocAtParams *params) {
 	sti();
-// TODO make sure vaddr is not already occupied
-	return (int) virt_alloc_pages((uint) params->pages, (void *) params->vaddr);
+	void *vaddr = (void *) ((uint) params->vaddr & 0xFFFFF000);
+
+	// fails if any of the range is already allocated
+	if (!thisProc->vm.reserve(vaddr, params->pages, PAGE_USER_DATA)) return 0;
+
+	if (virt_alloc_pages((uint) params->pages, vaddr) == nullptr) {
+		virt_free_pages(vaddr, params->pages);
+		thisProc->vm.release(vaddr);
+		return 0;
+	}
+	thisProc->mem_stats.alloc_bytes += params->pages * sizeof(PageFrame);
+	return (int) vaddr;
+}
+
+int syscall_free(void *vaddr) {
+	sti();
+	if (!thisProc->vm.contains(vaddr)) return 0;
+
+	// thread stacks and the environment page belong to the kernel, see `VMSpace::mark_kernel_owned()`
+	uint pages = thisProc->vm.claim(vaddr, false);
+	if (pages == 0) return 0;
+	// unmapped before the area goes, see `virt_release()`
+	virt_free_pages(vaddr, pages);
+	thisProc->vm.release(vaddr);
+
+	// areas the loader mapped can be freed too, they were never counted
+	uint bytes = pages * sizeof(PageFrame);
+	MemStats *stats = &thisProc->mem_stats;
+	stats->alloc_bytes = (bytes < stats->alloc_bytes) ? stats->alloc_bytes - bytes : 0;
+
+	return pages;
+}
+
+int syscall_mem_stats(MemStats *stats) {
+	*stats = thisProc->mem_stats;
+
+	stats->total_frames = page_allocator->max_bits;
+	stats->free_frames = count_free_frames();
+	return 1;
 }
 
 
@@ -92,7 +134,16 @@ int syscall_write(SyscallWriteParams *params) {
 
 int syscall_new_thread(SyscallThreadParams *params) {
 	Thread *thread = new_user_thread(params->function, 0);
-	return (int) (thread != nullptr);
+	return (thread != nullptr) ? (int) thread->index : -1;
+}
+
+int syscall_thread_exit(int exit_code) {
+	exit_thread(exit_code);
+	return 0;
+}
+
+int syscall_thread_join(SyscallJoinParams *params) {
+	return join_thread((uint) params->thread_id, &params->exit_code) ? 1 : 0;
 }
 
 int syscall_yield() {
@@ -100,15 +151,38 @@ int syscall_yield() {
 	return 1;
 }
 
+int syscall_set_priority(uint priority) {
+	// the calling thread only, and never into the kernel's levels
+	if ((priority < PRIORITY_USER_MAX) || (priority >= NUM_PRIORITIES)) return 0;
+
+	set_thread_priority(thisThread, priority);
+	return 1;
+}
+
+int syscall_sleep(uint ms) {
+	if (ms == 0) {
+		yield();
+	} else {
+		sleep_thread(ms);
+	}
+	return 1;
+}
+
 int syscall_get_environment() {
 	if (thisProc->userEnv == nullptr) {
 
 		void *env_paddr = get_physical(thisProc->env);
 
 		// user-visible address:
-		thisProc->userEnv = (Environment *) next_virtual_pages(1);
+		Environment *user_env = (Environment *) next_virtual_pages(1);
+		if (user_env == nullptr) return 0;
 
-		map_to( thisProc->userEnv, env_paddr, PAGE_USER_DATA);
+		if (map_to(user_env, env_paddr, PAGE_USER_DATA) == nullptr) {
+			thisProc->vm.release(user_env);
+			return 0;
+		}
+		thisProc->vm.mark_kernel_owned(user_env);
+		thisProc->userEnv = user_env;
 		
 	}
 	return (int) thisProc->userEnv;
@@ -124,15 +198,17 @@ int syscall_lock(int lock_h) {
 	return 1;
 }
 
+int syscall_timed_lock(SyscallLockParams *params) {
+	return thisProc->lock(thisProc->get_lock(params->lock_h), params->timeout_ms) ? 1 : 0;
+}
+
 int syscall_unlock(int lock_h) {
 	thisProc->unlock(thisProc->get_lock(lock_h));
 	return 1;
 }
 
 int syscall_monitor(SyscallMonitorParams *params) {
-	params->dump();
-	monitor(params->monitor_h, params->diff);
-	return 1;
+	return monitor(params->monitor_h, params->diff, params->timeout_ms) ? 1 : 0;
 }
 
 int syscall_unmonitor(int monitor_h) {
@@ -141,11 +217,55 @@ int syscall_unmonitor(int monitor_h) {
 }
 
 int syscall_notify(SyscallMonitorParams *params) {
-	params->dump();
 	notify(params->monitor_h, params->diff);
 	return 1;
 }
 
+int syscall_wait_any(SyscallWaitAnyParams *params) {
+	// the handles are read here, before any spinlock is held
+	return (int) thisProc->wait_any(params->monitor_hs, params->count, params->timeout_ms);
+}
+
+int syscall_rwlock_read(SyscallLockParams *params) {
+	unsigned long long deadline = (params->timeout_ms != 0) ? deadline_after(params->timeout_ms) : 0;
+	return rwlock_read(thisProc->get_rwlock(params->lock_h), deadline) ? 1 : 0;
+}
+
+int syscall_rwlock_write(SyscallLockParams *params) {
+	unsigned long long deadline = (params->timeout_ms != 0) ? deadline_after(params->timeout_ms) : 0;
+	return rwlock_write(thisProc->get_rwlock(params->lock_h), deadline) ? 1 : 0;
+}
+
+int syscall_rwlock_unlock(int rwlock_h) {
+	rwlock_release(thisProc->get_rwlock(rwlock_h));
+	return 1;
+}
+
+int syscall_sem_wait(SyscallSemParams *params) {
+	unsigned long long deadline = (params->timeout_ms != 0) ? deadline_after(params->timeout_ms) : 0;
+	return sem_wait(thisProc->get_semaphore(params->sem_h), deadline) ? 1 : 0;
+}
+
+int syscall_sem_post(SyscallSemParams *params) {
+	sem_post(thisProc->get_semaphore(params->sem_h), params->count);
+	return 1;
+}
+
+static bool is_futex_addr(volatile uint *addr) {
+	// a word-aligned user address, so the kernel never waits on its own memory
+	return (((uint) addr & 3) == 0) && ((uint) addr >= USER_VIRT_BASE) && ((uint) addr < USER_VIRT_LIMIT);
+}
+
+int syscall_futex_wait(SyscallFutexParams *params) {
+	if (!is_futex_addr(params->addr)) return 0;
+	return futex_wait(thisProc, params->addr, params->value, params->timeout_ms);
+}
+
+int syscall_futex_wake(SyscallFutexParams *params) {
+	if (!is_futex_addr(params->addr)) return 0;
+	return futex_wake(thisProc, params->addr, params->value);
+}
+
 int syscall_update_gui() {
 
 	gui_update_proc(proc_id);
@@ -186,19 +306,22 @@ void enter_kernel() {
 		"movl $0x10, %%edx\n"
 		"movw %%dx, %%ds\n"
 		"movw %%dx, %%es\n"
+		"movw %[percpu], %%dx\n"
+		"movw %%dx, %%gs\n"
 
-		"movl %[syscall_esp], %%esp\n"
+		"movl %%gs:%c[syscall_esp], %%esp\n"
 
 		"pushl %%edi\n" // old esp
 
 		"call do_syscall\n"
-	::[syscall_esp]"m"(thisProc->threads[thisProc->thread_index].syscall_esp));
+	::[percpu] "i"(PERCPU_SELECTOR), [syscall_esp] "i"(__builtin_offsetof(PerCPU, syscall_esp)));
 
 	__asm__ volatile(
 		//"addl $0x04, %esp\n"
 		"movl $0x23, %edx\n"
 		"movw %dx, %ds\n"
 		"movw %dx, %es\n"
+		"movw %dx, %gs\n"
 
 		"pop %ecx\n"
 		"movl $after_sysexit, %edx\n"
@@ -210,12 +333,11 @@ void enter_kernel() {
 
 }
 
-void init_syscall() {
+void init_syscall_cpu() {
 
-	// ESP value for when `sysenter` first enters ring 0
-	void *syscall_stack;
+	// ESP value for when `sysenter` first enters ring 0, allocated by whoever started this CPU
+	PerCPU *cpu = this_cpu();
 	int syscall_stack_bytes = sizeof(PageFrame) * SYSCALL_STACK_PAGES;
-	syscall_stack = static_alloc_pages(SYSCALL_STACK_PAGES);
 
 	volatile uint edx;
 	volatile uint eax;
@@ -228,7 +350,7 @@ void init_syscall() {
 
 	// Set the ring 0 esp in the IA_SYSENTER_ESP MSR (0x175)
 	edx = 0x0;
-	eax = (uint) syscall_stack + syscall_stack_bytes;
+	eax = (uint) cpu->syscall_entry_stack + syscall_stack_bytes;
 	ecx = 0x175;
 	__asm__ volatile("wrmsr"::"a"(eax), "d"(edx), "c"(ecx));
 
@@ -237,7 +359,12 @@ void init_syscall() {
 	eax = (uint) &enter_kernel;
 	ecx = 0x176;
 	__asm__ volatile("wrmsr"::"a"(eax), "d"(edx), "c"(ecx));
+}
+
+void init_syscall() {
 
+	this_cpu()->syscall_entry_stack = static_alloc_pages(SYSCALL_STACK_PAGES);
+	init_syscall_cpu();
 
 	// set up syscall table
 
@@ -246,6 +373,7 @@ void init_syscall() {
 
 	syscall_table[(int) SYSCALL_ALLOC] = (SyscallPtr) syscall_alloc;
 	syscall_table[(int) SYSCALL_ALLOC_AT] = (SyscallPtr) syscall_alloc_at;
+	syscall_table[(int) SYSCALL_FREE] = (SyscallPtr) syscall_free;
 
 	syscall_table[(int) SYSCALL_OPEN] = (SyscallPtr) syscall_open;
 	syscall_table[(int) SYSCALL_SEEK] = (SyscallPtr) syscall_seek;
@@ -253,7 +381,11 @@ void init_syscall() {
 	syscall_table[(int) SYSCALL_WRITE] = (SyscallPtr) syscall_write;
 
 	syscall_table[(int) SYSCALL_NEW_THREAD] = (SyscallPtr) syscall_new_thread;
+	syscall_table[(int) SYSCALL_THREAD_EXIT] = (SyscallPtr) syscall_thread_exit;
+	syscall_table[(int) SYSCALL_THREAD_JOIN] = (SyscallPtr) syscall_thread_join;
 	syscall_table[(int) SYSCALL_YIELD] = (SyscallPtr) syscall_yield;
+	syscall_table[(int) SYSCALL_SET_PRIORITY] = (SyscallPtr) syscall_set_priority;
+	syscall_table[(int) SYSCALL_SLEEP] = (SyscallPtr) syscall_sleep;
 
 
 	syscall_table[(int) SYSCALL_SUBSCRIBE] = (SyscallPtr) syscall_subscribe;
@@ -261,15 +393,29 @@ void init_syscall() {
 
 
 	syscall_table[(int) SYSCALL_LOCK] = (SyscallPtr) syscall_lock;
+	syscall_table[(int) SYSCALL_TIMED_LOCK] = (SyscallPtr) syscall_timed_lock;
 	syscall_table[(int) SYSCALL_UNLOCK] = (SyscallPtr) syscall_unlock;
 
 	syscall_table[(int) SYSCALL_MONITOR] = (SyscallPtr) syscall_monitor;
 	syscall_table[(int) SYSCALL_UNMONITOR] = (SyscallPtr) syscall_unmonitor;
 	syscall_table[(int) SYSCALL_NOTIFY] = (SyscallPtr) syscall_notify;
+	syscall_table[(int) SYSCALL_WAIT_ANY] = (SyscallPtr) syscall_wait_any;
+
+	syscall_table[(int) SYSCALL_FUTEX_WAIT] = (SyscallPtr) syscall_futex_wait;
+	syscall_table[(int) SYSCALL_FUTEX_WAKE] = (SyscallPtr) syscall_futex_wake;
+
+	syscall_table[(int) SYSCALL_RWLOCK_READ] = (SyscallPtr) syscall_rwlock_read;
+	syscall_table[(int) SYSCALL_RWLOCK_WRITE] = (SyscallPtr) syscall_rwlock_write;
+	syscall_table[(int) SYSCALL_RWLOCK_UNLOCK] = (SyscallPtr) syscall_rwlock_unlock;
+
+	syscall_table[(int) SYSCALL_SEM_WAIT] = (SyscallPtr) syscall_sem_wait;
+	syscall_table[(int) SYSCALL_SEM_POST] = (SyscallPtr) syscall_sem_post;
 
 	syscall_table[(int) SYSCALL_UPDATE_GUI] = (SyscallPtr) syscall_update_gui;
 	syscall_table[(int) SYSCALL_REDRAW_GUI] = (SyscallPtr) syscall_redraw_gui;
 
+	syscall_table[(int) SYSCALL_MEM_STATS] = (SyscallPtr) syscall_mem_stats;
+
 }
 
 #pragma pop_macro("DEBUG_LEVEL")
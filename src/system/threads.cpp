@@ -2,16 +2,15 @@
 #include <devices/cpu.h>
 #include <threads.h>
 #include <process.h>
+#include <scheduler.h>
 #include <memory.h>
+#include <locks.h>
 
 #pragma push_macro("DEBUG_LEVEL")
 
 #define DEBUG_LEVEL 1
 
 
-Thread *thisThread;
-
-
 void ThreadState::dump() {
 	debug(1, " Thread state @ ", (hex) this);
 	debug(1, " eax=",(hex)eax," ecx=",(hex)ecx," edx=",(hex)edx, " ebx=", (hex) ebx);
@@ -78,42 +77,175 @@ void Thread::dump() {
 }
 
 
+static void *take_cached(void **cache, uint *count) {
+	return (*count > 0) ? cache[--(*count)] : nullptr;
+}
+
+static void cache_or_release(void *vaddr, void **cache, uint *count) {
+	if (*count < MAX_CACHED_STACKS) {
+		cache[(*count)++] = vaddr;
+	} else {
+		virt_release(vaddr);
+	}
+}
+
+static void release_user_stack(Process *proc, void *stack, uint stack_bytes) {
+	if (stack_bytes == USER_STACK_BYTES) {
+		cache_or_release(stack, proc->stack_cache.stacks, &proc->stack_cache.num_stacks);
+	} else {
+		virt_release(stack);
+	}
+}
+
 UserThread *new_user_thread(void *function, int data, uint stack_bytes, void *stack) {
 
+	Process *proc = thisProc;
+	lock_acquire(&proc->thread_lock);
+
 	for (int i = 0; i < MAX_PROC_THREADS; i++) {
-		if (thisProc->threads[i].runState == ThreadRunState::NULL) {
-			UserThread *newThread = &thisProc->threads[i];
+		if (proc->threads[i].runState == ThreadRunState::NULL) {
+			UserThread *newThread = &proc->threads[i];
 
-			if (stack_bytes == 0) stack_bytes = 16 * 4096;
+			if (stack_bytes == 0) stack_bytes = USER_STACK_BYTES;
 			uint stack_pages = (stack_bytes + 4095) / sizeof(PageFrame);
+			newThread->owns_stack = (stack == nullptr);
+			if ((stack == nullptr) && (stack_bytes == USER_STACK_BYTES)) {
+				// an exited thread's stack still has its top page, and whatever else it touched, mapped
+				// cached stacks stay kernel-owned, so `syscall_free()` can't have taken one. Should the area be gone anyway, skip it rather than fault in `init()`
+				do {
+					stack = take_cached(proc->stack_cache.stacks, &proc->stack_cache.num_stacks);
+				} while ((stack != nullptr) && !proc->vm.mark_kernel_owned(stack));
+			}
 			if (stack == nullptr) {
-				// NOTE if we had called virt_alloc_page before here, we'd have to release the memory if new_user_thread failed.
-				stack = virt_alloc_pages(stack_pages);
+				stack = virt_alloc_pages(stack_pages, PAGE_USER_LAZY);
+				if (stack == nullptr) break;
+				// the top page holds our saved state, freeing it would fault the next interrupt from ring 3
+				proc->vm.mark_kernel_owned(stack);
+
+				// the top page holds the thread's saved CPU state and is where ESP0 points, so it must exist before the first interrupt
+				if (virt_alloc_page(&((PageFrame *) stack)[stack_pages - 1], PAGE_USER_DATA) == nullptr) {
+					virt_release(stack);
+					break;
+				}
+			}
+
+			void *syscall_stack = take_cached(proc->stack_cache.syscall_stacks, &proc->stack_cache.num_syscall_stacks);
+			// mapped eagerly: a fault on a missing kernel stack page couldn't push its own interrupt frame
+			if (syscall_stack == nullptr) syscall_stack = virt_alloc_pages(USER_SYSCALL_STACK_PAGES, PAGE_KERNEL_DATA);
+			if (syscall_stack == nullptr) {
+				if (newThread->owns_stack) release_user_stack(proc, stack, stack_bytes);
+				break;
 			}
 
 			newThread->init((void *) function, stack, stack_bytes);
-			uint syscall_stack_pages = 16;
-			newThread->syscall_stack_bytes = syscall_stack_pages * sizeof(PageFrame);
-			newThread->syscall_stack = virt_alloc_pages(syscall_stack_pages, PAGE_KERNEL_DATA);
+
+			// let libsystem find this thread from its stack pointer
+			proc->env->thread_stacks[i].base = (uint) stack;
+			proc->env->thread_stacks[i].limit = (uint) stack + stack_bytes;
+
+			newThread->syscall_stack_bytes = USER_SYSCALL_STACK_PAGES * sizeof(PageFrame);
+			newThread->syscall_stack = syscall_stack;
 			newThread->syscall_esp = (uint) newThread->syscall_stack + newThread->syscall_stack_bytes;
 
 			// TODO move to ctor
-			newThread->lock_next = nullptr;
-			newThread->signal_wait = nullptr;
-
-			newThread->runState = ThreadRunState::RUNNING;
-			thisProc->num_running_threads++;
+			newThread->wait_next = nullptr;
+			newThread->wait_prev = nullptr;
+			newThread->wait_queue = nullptr;
+			newThread->blocked_on = nullptr;
+			newThread->held_locks = nullptr;
+			newThread->num_read_held = 0;
+			newThread->futex_next = nullptr;
+			newThread->futex_addr = nullptr;
+			newThread->exit_code = 0;
+
+			newThread->base_priority = PRIORITY_DEFAULT;
+			newThread->inherited_priority = NUM_PRIORITIES;
+			newThread->priority = PRIORITY_DEFAULT;
+			// start on the creating CPU's queue, idle CPUs will take it from there
+			newThread->cpu = this_cpu()->id;
+			newThread->on_cpu = false;
+			wake_thread(newThread);
+
+			lock_release(&proc->thread_lock);
 			return newThread;
 		}
 	}
+
+	lock_release(&proc->thread_lock);
 	return nullptr;
 }
 
+void exit_thread(int exit_code) {
+	UserThread *thread = (UserThread *) thisThread;
+	Process *proc = thread->proc;
+
+	// nobody could ever take these back from a thread that's gone
+	while (thread->held_locks != nullptr) lock_release(thread->held_locks);
+	while (thread->num_read_held > 0) rwlock_release(thread->read_held[thread->num_read_held - 1]);
+
+	lock_acquire(&proc->thread_lock);
+
+	thread->exit_code = exit_code;
+
+	// libsystem mustn't mistake a later thread on these addresses for us
+	proc->env->thread_stacks[thread->index].base = 0;
+	proc->env->thread_stacks[thread->index].limit = 0;
+
+	// once DONE we're never picked again, so nothing may switch us away while we still hold `thread_lock`
+	cli();
+	finish_thread(thread);
+	cond_broadcast(&proc->thread_exited);
+	lock_release(&proc->thread_lock);
+
+	schedule();
+
+	// never gets here
+	SPINJMP();
+}
+
+static void reap_thread(Process *proc, UserThread *thread) {
+// free a DONE thread's slot, caching its stacks. Called with `thread_lock` held
+
+	// its CPU saves its state on these stacks on the way out, which may not have happened yet
+	while (thread->on_cpu) __asm__ volatile("pause");
+
+	if (thread->owns_stack) release_user_stack(proc, thread->stack, thread->stack_bytes);
+	cache_or_release(thread->syscall_stack, proc->stack_cache.syscall_stacks, &proc->stack_cache.num_syscall_stacks);
+
+	thread->stack = nullptr;
+	thread->syscall_stack = nullptr;
+	thread->runState = ThreadRunState::NULL;
+}
+
+bool join_thread(uint index, int *exit_code) {
+	Process *proc = thisProc;
+	if (index >= MAX_PROC_THREADS) return false;
+
+	UserThread *thread = &proc->threads[index];
+	if (thread == thisThread) return false;
+
+	lock_acquire(&proc->thread_lock);
+
+	while ((thread->runState == RUNNING) || (thread->runState == WAITING)) {
+		cond_wait(&proc->thread_exited, &proc->thread_lock);
+	}
+
+	bool joined = (thread->runState == DONE);
+	if (joined) {
+		*exit_code = thread->exit_code;
+		reap_thread(proc, thread);
+	}
+
+	lock_release(&proc->thread_lock);
+	return joined;
+}
+
 void yield() {
+	// a blocked thread only comes back here once it's been woken and picked again
 	sti();
 	do {
 		debug(9, "Y");
-		__asm__ volatile("hlt");
+		schedule();
 	} while (thisThread->runState != RUNNING);
 }
 
@@ -0,0 +1,266 @@
+#include <new>
+#include <std/types.h>
+#include <std/random.h>
+#include <devices/cpu.h>
+#include <memory.h>
+#include <slab.h>
+#include <vmspace.h>
+#include <util/debug.h>
+
+#pragma push_macro("DEBUG_LEVEL")
+
+#define DEBUG_LEVEL 0
+
+VMSpace kernel_vm;
+
+static SlabCache *area_cache;
+
+static void update(VMArea *n) {
+	// recompute the subtree summary of `n` from its children
+	VMArea *l = n->left;
+	VMArea *r = n->right;
+
+	n->lo = l ? l->lo : n->start;
+	n->hi = r ? r->hi : n->end;
+
+	uint gap = 0;
+	if (l) {
+		if (l->max_gap > gap) gap = l->max_gap;
+		if (n->start - l->hi > gap) gap = n->start - l->hi;
+	}
+	if (r) {
+		if (r->max_gap > gap) gap = r->max_gap;
+		if (r->lo - n->end > gap) gap = r->lo - n->end;
+	}
+	n->max_gap = gap;
+}
+
+static void split(VMArea *t, uint key, VMArea *&l, VMArea *&r) {
+	// areas starting below `key` go to `l`, the rest to `r`
+	if (t == nullptr) {
+		l = r = nullptr;
+		return;
+	}
+	if (t->start < key) {
+		split(t->right, key, t->right, r);
+		l = t;
+	} else {
+		split(t->left, key, l, t->left);
+		r = t;
+	}
+	update(t);
+}
+
+static VMArea *merge(VMArea *l, VMArea *r) {
+	// every area in `l` must be below every area in `r`
+	if (l == nullptr) return r;
+	if (r == nullptr) return l;
+
+	if (l->priority > r->priority) {
+		l->right = merge(l->right, r);
+		update(l);
+		return l;
+	}
+	r->left = merge(l, r->left);
+	update(r);
+	return r;
+}
+
+static VMArea *new_area(uint start, uint end, uint attributes) {
+	VMArea *area = (VMArea *) slab_alloc(area_cache);
+	if (area == nullptr) return nullptr;
+
+	area->start = start;
+	area->end = end;
+	area->attributes = attributes;
+	area->kernel_owned = false;
+	area->releasing = false;
+	area->left = nullptr;
+	area->right = nullptr;
+	area->priority = prand();
+	update(area);
+	return area;
+}
+
+void VMSpace::init(uint base, uint limit) {
+	this->base = base;
+	this->limit = limit;
+	root = nullptr;
+	mutex.locked = 0;
+}
+
+uint VMSpace::find_gap(uint bytes) {
+	// lowest address with `bytes` unused after it, or 0
+	if (root == nullptr) {
+		return (limit - base >= bytes) ? base : 0;
+	}
+	if (root->lo - base >= bytes) return base;
+
+	VMArea *n = root;
+	while (n != nullptr) {
+		if (n->left && (n->left->max_gap >= bytes)) {
+			n = n->left;
+			continue;
+		}
+		if (n->left && (n->start - n->left->hi >= bytes)) return n->left->hi;
+		if (n->right && (n->right->lo - n->end >= bytes)) return n->end;
+		if (n->right && (n->right->max_gap >= bytes)) {
+			n = n->right;
+			continue;
+		}
+		break;
+	}
+
+	if (limit - root->hi >= bytes) return root->hi;
+	return 0;
+}
+
+void *VMSpace::alloc(uint pages, uint attributes) {
+	// more than the whole range would also wrap `bytes`
+	if ((pages == 0) || (pages > (limit - base) / 4096)) return nullptr;
+	uint bytes = pages * 4096;
+
+	uint flags = irq_save();
+	mutex.lock();
+
+	void *vaddr = nullptr;
+	uint start = find_gap(bytes);
+	if (start != 0) {
+		VMArea *area = new_area(start, start + bytes, attributes);
+		if (area != nullptr) {
+			VMArea *l, *r;
+			split(root, start, l, r);
+			root = merge(merge(l, area), r);
+			vaddr = (void *) start;
+		}
+	}
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return vaddr;
+}
+
+bool VMSpace::reserve(void *vaddr, uint pages, uint attributes) {
+	if ((pages == 0) || (pages > (limit - base) / 4096)) return false;
+
+	uint start = (uint) vaddr & 0xFFFFF000;
+	uint end = start + pages * 4096;
+	if ((start < base) || (end > limit) || (end < start)) return false;
+
+	uint flags = irq_save();
+	mutex.lock();
+
+	VMArea *l, *r;
+	split(root, start, l, r);
+
+	// areas are disjoint and sorted, so only the last area of `l` and the first of `r` can overlap
+	bool ok = !(l && (l->hi > start)) && !(r && (r->lo < end));
+	VMArea *area = nullptr;
+	if (ok) {
+		area = new_area(start, end, attributes);
+		ok = (area != nullptr);
+	}
+	if (ok) l = merge(l, area);
+	root = merge(l, r);
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return ok;
+}
+
+VMArea *VMSpace::find(void *vaddr) {
+	uint addr = (uint) vaddr;
+
+	uint flags = irq_save();
+	mutex.lock();
+
+	// last area starting at or below `addr`:
+	VMArea *best = nullptr;
+	VMArea *n = root;
+	while (n != nullptr) {
+		if (n->start <= addr) {
+			best = n;
+			n = n->right;
+		} else {
+			n = n->left;
+		}
+	}
+	if (best && (addr >= best->end)) best = nullptr;
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return best;
+}
+
+VMArea *VMSpace::find_start(uint start) {
+	// the area starting exactly at `start`, called with `mutex` held
+	VMArea *n = root;
+	while ((n != nullptr) && (n->start != start)) {
+		n = (start < n->start) ? n->left : n->right;
+	}
+	return n;
+}
+
+uint VMSpace::claim(void *vaddr, bool kernel) {
+	uint flags = irq_save();
+	mutex.lock();
+
+	// only flags change, so the tree doesn't move
+	VMArea *n = find_start((uint) vaddr);
+
+	uint pages = 0;
+	if ((n != nullptr) && !n->releasing && (kernel || !n->kernel_owned)) {
+		n->releasing = true;
+		pages = n->pages();
+	}
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return pages;
+}
+
+uint VMSpace::release(void *vaddr) {
+	uint start = (uint) vaddr;
+
+	uint flags = irq_save();
+	mutex.lock();
+
+	VMArea *l, *m, *r;
+	split(root, start, l, r);
+	split(r, start + 1, m, r);
+	root = merge(l, r);
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	if (m == nullptr) return 0;
+
+	uint pages = m->pages();
+	slab_free(m);
+	return pages;
+}
+
+bool VMSpace::mark_kernel_owned(void *vaddr) {
+	uint flags = irq_save();
+	mutex.lock();
+
+	// only flags change, so the tree doesn't move
+	VMArea *n = find_start((uint) vaddr);
+	if (n != nullptr) n->kernel_owned = true;
+
+	mutex.unlock();
+	irq_restore(flags);
+
+	return n != nullptr;
+}
+
+void init_vmspace() {
+	area_cache = slab_cache_create("VMArea", sizeof(VMArea));
+	kernel_vm.init(KERNEL_VM_BASE, KERNEL_VIRT_LIMIT);
+}
+
+#pragma pop_macro("DEBUG_LEVEL")
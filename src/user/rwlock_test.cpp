@@ -0,0 +1,84 @@
+#include <std/types.h>
+#include <system.h>
+#include <console.h>
+#include "rwlock_test.h"
+
+/*
+ Checks on the kernel rwlocks that only show up with several threads:
+ - a writer that times out while readers hold the lock lets in the readers that queued behind it
+ - a release from a thread that holds nothing doesn't drop anybody's read hold
+*/
+
+// a handle nothing else in the shell uses
+#define TEST_RWLOCK 1
+
+static volatile int writer_result;
+static volatile int reader_in;
+
+static void timed_writer() {
+	writer_result = sysapi::rwlock_write(TEST_RWLOCK, 100);
+	if (writer_result) sysapi::rwlock_unlock(TEST_RWLOCK);
+	sysapi::thread_exit(0);
+}
+
+static void queued_reader() {
+	sysapi::rwlock_read(TEST_RWLOCK);
+	reader_in = 1;
+	sysapi::rwlock_unlock(TEST_RWLOCK);
+	sysapi::thread_exit(0);
+}
+
+static void stray_release() {
+	sysapi::rwlock_unlock(TEST_RWLOCK);
+	sysapi::thread_exit(0);
+}
+
+static bool check(const char *what, bool ok) {
+	println(ok ? "PASS " : "FAIL ", what);
+	return ok;
+}
+
+static bool test_writer_timeout() {
+	writer_result = -1;
+	reader_in = 0;
+
+	sysapi::rwlock_read(TEST_RWLOCK);
+
+	int writer = sysapi::new_thread((void *) timed_writer);
+	sysapi::sleep(20);
+	// queues behind the waiting writer
+	int reader = sysapi::new_thread((void *) queued_reader);
+	sysapi::sleep(20);
+	bool ok = check("reader waits behind writer", reader_in == 0);
+
+	sysapi::thread_join(writer);
+	ok &= check("writer times out", writer_result == 0);
+
+	// we still hold our read lock, the queued reader must get in anyway
+	sysapi::sleep(50);
+	ok &= check("reader admitted after timeout", reader_in == 1);
+
+	sysapi::rwlock_unlock(TEST_RWLOCK);
+	sysapi::thread_join(reader);
+	return ok;
+}
+
+static bool test_stray_release() {
+	sysapi::rwlock_read(TEST_RWLOCK);
+
+	sysapi::thread_join(sysapi::new_thread((void *) stray_release));
+
+	// if the stray release dropped our hold, a writer gets in alongside us
+	int wrote = sysapi::rwlock_write(TEST_RWLOCK, 20);
+	if (wrote) sysapi::rwlock_unlock(TEST_RWLOCK);
+	bool ok = check("stray release ignored", wrote == 0);
+
+	sysapi::rwlock_unlock(TEST_RWLOCK);
+	return ok;
+}
+
+void rwlock_test() {
+	bool ok = test_writer_timeout();
+	ok &= test_stray_release();
+	println(ok ? "rwlock tests passed" : "rwlock tests FAILED");
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// run the kernel rwlock checks that need several threads, printing PASS/FAIL for each
+void rwlock_test();
@@ -0,0 +1,74 @@
+#include <std/types.h>
+#include <system.h>
+#include <console.h>
+#include "scaling.h"
+
+/*
+ A CPU-bound multi-threaded test for the scheduler.
+ Every worker spins through the same fixed loop without syscalls or shared writes, so on enough CPUs `n` workers should finish in about the time one does.
+ Times are TSC cycles measured by the thread that starts and joins the workers.
+*/
+
+// iterations per worker
+#define SCALING_WORK (1 << 26)
+
+static volatile uint scaling_sink;
+
+static void scaling_worker() {
+	uint x = 0x2545F491;
+	for (uint i = 0; i < SCALING_WORK; i++) {
+		// xorshift, so the loop can't be folded away
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	scaling_sink = x;
+
+	sysapi::thread_exit(0);
+}
+
+static uint run_workers(int count) {
+	// start `count` workers and wait for all of them
+	// returns the elapsed cycles / 64K (32-bit, we don't link the 64-bit division helpers), 0 if a worker couldn't be started
+	int thread_ids[MAX_SCALING_THREADS];
+
+	unsigned long long start = __builtin_ia32_rdtsc();
+
+	int started = 0;
+	while (started < count) {
+		int id = sysapi::new_thread((void *) scaling_worker);
+		if (id < 0) break;
+		thread_ids[started++] = id;
+	}
+	for (int i = 0; i < started; i++) {
+		sysapi::thread_join(thread_ids[i]);
+	}
+
+	unsigned long long cycles = __builtin_ia32_rdtsc() - start;
+
+	if (started < count) return 0;
+	uint elapsed = (uint) (cycles >> 16);
+	return (elapsed > 0) ? elapsed : 1;
+}
+
+void scaling_test(int max_threads) {
+	if (max_threads < 1) max_threads = 1;
+	if (max_threads > MAX_SCALING_THREADS) max_threads = MAX_SCALING_THREADS;
+
+	println("Each worker spins ", (uint) SCALING_WORK, " times");
+
+	uint one_thread = 0;
+	for (int n = 1; n <= max_threads; n *= 2) {
+		uint elapsed = run_workers(n);
+		if (elapsed == 0) {
+			println("Couldn't start ", n, " threads");
+			return;
+		}
+		if (n == 1) one_thread = elapsed;
+
+		// `n` times the work in the time one worker takes is perfect scaling, in hundredths to stay integer
+		uint speedup = n * one_thread * 100 / elapsed;
+		const char *pad = (speedup % 100 < 10) ? "0" : "";
+		println(n, " threads: ", elapsed, "x64K cycles, speedup ", speedup / 100, ".", pad, speedup % 100);
+	}
+}
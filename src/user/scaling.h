@@ -0,0 +1,7 @@
+#pragma once
+
+// the shell's own threads count against MAX_PROC_THREADS too
+#define MAX_SCALING_THREADS 8
+
+// run CPU-bound workers 1, 2, 4.. up to `max_threads` at a time and print how the elapsed time scales
+void scaling_test(int max_threads);
@@ -8,6 +8,8 @@
 #include <gui/terminal.h>
 #include <system.h>
 #include <console.h>
+#include "scaling.h"
+#include "rwlock_test.h"
 
 
 struct GUIModel {
@@ -29,6 +31,18 @@ void event_thread();
 void display_help() {
 	println("Shell commands:");	
 	println("help      Display this help message");
+	println("scaling N Time CPU-bound threads, up to N");
+	println("rwtest    Check kernel rwlocks");
+}
+
+int parse_uint(const char *str) {
+	// the leading decimal digits of `str`, 0 if there aren't any
+	int value = 0;
+	while ((*str >= '0') && (*str <= '9')) {
+		value = value * 10 + (*str - '0');
+		str++;
+	}
+	return value;
 }
 
 extern "C" void _start() {
@@ -67,6 +81,11 @@ extern "C" void _start() {
 		command[len-1] = 0;
 		if (strncmp((char *) command, "help", 4) == 0) {
 			display_help();
+		} else if (strncmp((char *) command, "scaling", 7) == 0) {
+			int max_threads = (command[7] == ' ') ? parse_uint(&command[8]) : 0;
+			scaling_test((max_threads > 0) ? max_threads : 4);
+		} else if (strncmp((char *) command, "rwtest", 6) == 0) {
+			rwlock_test();
 		} else {
 			println("Unrecognized command: ", command);
 		}
@@ -132,6 +151,7 @@ GUIModel::GUIModel():
 	bg->color = SET_ALPHA(1) + fast_blend(GREY, fast_blend(BLUE, RED));
 
 
+	// not malloc'd: the kernel draws this buffer and expects it inside the Environment page
 	TextBox::Buffer<> *buf = (TextBox::Buffer<> *) new (sysapi::process_env->free) TextBox::Buffer<45,20>();
 
 	buf->offset_y = 0;